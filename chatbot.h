@@ -2,11 +2,24 @@
 // Author: Adrienne Cho Kwan
 // Date: July 2020
 
+#ifndef CHATBOT_H
+#define CHATBOT_H
+
 #include <iostream>
 #include <string>
 #include <array>
 #include <vector>
 #include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <initializer_list>
+#include <memory_resource>
+#include <string_view>
+#include <utility>
+
+#include "chatbot_fuzzy.h"
+#include "chatbot_trace.h"
 
 using namespace std;
 
@@ -15,26 +28,61 @@ using namespace std;
 // Chatbot is a class that contains code for a chatbot. The public methods are:
 //
 //      Chatbot(const string x)         Creates instance, names Chatbot x
+//      Chatbot(const string x, pmr::memory_resource *resource)
+//                                      Same, but the session's memory (past
+//                                      inputs, user name, built replies and
+//                                      the turn arena) comes from resource
+//                                      (a Chatbot can't be copied or moved)
 //      void tell(string user_input)    Sets input from user
 //      string get_name()               Gets Chatbot's name
 //      string get_reply()              Gets output from Chatbot
+//      string_view get_reply_view()    Same, without copying (valid until the
+//                                      next tell())
+//      const trace_record_t &classify(string_view line)
+//                                      Finds which stage and key would answer
+//                                      line, without replying
+//      void set_fuzzy(bool on)         Lets keys match with typos
+//      string key_text(const trace_record_t &record)
+//                                      Gets the key that a trace record names
+//      string save_state()             Gets the session state as a string
+//      bool load_state(string_view state)
+//                                      Restores a state from save_state()
+//      size_t history_size()           Gets the number of past inputs
+//      string save_turn()              Gets what the last turn changed
+//      bool replay_turn(string_view turn)
+//                                      Applies a turn from save_turn() again
 //
 ////////////////////////////////////////////////////////////////////////////////
 
 class Chatbot
 {
 private:
-    string bot_name;  // Stores Chatbot name
-    string user_name; // Stores user name
-    string input_str; // Stores current input as a string
-    string output;    // Stores output
-    string subject;   // Stores subject
-    string object;    // Stores object
-    string verb;      // Stores input verb
-    string verb_pres; // Stores the present tense of the verb
-    string verb_ed;   // Stores the past tense of the verb (ending in "ed")
-    string verb_ing;  // Stores the form of the verb ending in "ing"
-    string rest;      // Stores rest of input (after verb)
+    // Memory for the session state that grows as it talks (past
+    // inputs, user_name and output) comes from the resource given
+    // to the constructor. Scratch data that only lives for one turn
+    // (input words, rest, reply options, turn_picks) comes from
+    // turn_arena, which gets its blocks from the same resource and
+    // is emptied all at once in refresh(). The keychains and their
+    // sent values are made by the constructor on the global heap
+    // and never grow after that, and the other strings keep their
+    // memory from turn to turn.
+    typedef pmr::string scratch_string;
+    typedef pmr::vector<scratch_string> scratch_words;
+    char turn_buffer[2048];
+    pmr::monotonic_buffer_resource turn_arena;
+
+    string bot_name;       // Stores Chatbot name
+    pmr::string user_name; // Stores user name
+    string input_str;      // Stores current input as a string
+    pmr::string output;    // Stores output that had to be built (not a stored out)
+    string_view reply;     // Stores the chosen output (a stored out or output)
+    string subject;        // Stores subject
+    string object;         // Stores object
+    string verb;           // Stores input verb
+    string verb_pres;      // Stores the present tense of the verb
+    string verb_ed;        // Stores the past tense of the verb (ending in "ed")
+    string verb_ing;       // Stores the form of the verb ending in "ing"
+    scratch_string rest{&turn_arena}; // Stores rest of input (after verb)
     enum tense
     {
         PAST_SIMP,
@@ -51,9 +99,9 @@ private:
         FUT_PERFPRO,
         NONE
     };
-    tense input_tense;          // Stores current input verb tense
-    vector<string> input;       // Stores current input as a vector of words
-    vector<string> past_inputs; // Stores all past inputs
+    tense input_tense;                    // Stores current input verb tense
+    scratch_words input{&turn_arena};     // Stores current input as a vector of words
+    pmr::vector<pmr::string> past_inputs; // Stores all past inputs
 
     // Each "keychain" struct has three vectors:
     //  "in" has key inputs (words/phrases)
@@ -126,6 +174,156 @@ private:
 
     tense_struct tense_help = {{"ll have been", "ll have", "ll be", "'ll", "will", "ve been", "s been", "have", "'ve", "has", "am", "are", "is", "'m", "'re", "'s", "had been", "had", "was", "were", "did", ""}, {"ing", "ed", "ing", "", "", "ing", "ing", "ed", "ed", "ed", "ing", "ing", "ing", "ing", "ing", "ing", "ing", "ed", "ing", "ing", "", "ed"}, {FUT_PERFPRO, FUT_PERF, FUT_PRO, FUT_SIMP, FUT_SIMP, PRES_PERFPRO, PRES_PERFPRO, PRES_PERF, PRES_PERF, PRES_PERF, PRES_PRO, PRES_PRO, PRES_PRO, PRES_PRO, PRES_PRO, PRES_PRO, PAST_PERFPRO, PAST_PERF, PAST_PRO, PAST_PRO, PAST_SIMP, PAST_SIMP}};
 
+    // The result of analyze(), which reads the input
+    // once for everything that Ranks 2 and 3 need.
+    //  verb_word: index of the verb in input (-1 if none)
+    //  verb_set, verb_key: the verb key that matched
+    //  subject_id: index of the subject in subj_pros (-1 if none)
+    //  input_tense: tense of the input (NONE if not found)
+    //  rest_begin: index of the first word after the verb
+    typedef struct analysis_t
+    {
+        int verb_word;
+        int verb_set;
+        int verb_key;
+        int subject_id;
+        tense input_tense;
+        unsigned int rest_begin;
+    } analysis_t;
+    analysis_t analysis = {-1, -1, -1, -1, NONE, 0};
+
+    // If true, stages find a match but don't pick a reply (see
+    // classify()). They return "-" instead: any output will do,
+    // since classify() only needs to know one was found.
+    bool analyze_only = false;
+    bool fuzzy = false;          // If true, keys may match with typos (see set_fuzzy())
+    bool fuzzy_pass = false;     // True while stages run again allowing typos
+    unsigned int fuzzy_level = 0; // Mistakes a key may have in the fuzzy pass
+    uint64_t session_id;  // Identifies this Chatbot in trace records
+    uint32_t turns;       // Number of turns so far
+    trace_record_t trace; // Trace record of the current turn
+
+    // Lookup tables for analyze(), filled in by build_tables()
+    //  tense_before_at[c]: bit i is set if tense_help.before[i] starts with c
+    //  tense_in_verb_at[c]: bit i is set if tense_help.in_verb[i] starts with c
+    //  tense_before_always, tense_in_verb_always: bits of the empty keys
+    //  verb_keys_at[c]: the verb keys that start with c, in the
+    //      order of verb_sets (first set, then first key, wins)
+    //  subj_persons[i]: the person of subj_pros.out[i], used by find_be()
+    enum person
+    {
+        FIRST_PERSON,
+        PLURAL_PERSON,
+        THIRD_PERSON,
+        NO_PERSON
+    };
+    array<uint32_t, 256> tense_before_at = {};
+    array<uint32_t, 256> tense_in_verb_at = {};
+    uint32_t tense_before_always = 0;
+    uint32_t tense_in_verb_always = 0;
+    typedef struct verb_ref_t
+    {
+        uint16_t set;
+        uint16_t key;
+    } verb_ref_t;
+    array<vector<verb_ref_t>, 256> verb_keys_at;
+    vector<person> subj_persons;
+
+    // Each place an output is picked from, with its sent
+    // values: the session state that save_state() keeps.
+    typedef struct reply_source_t
+    {
+        vector<string> *out;
+        vector<bool> *sent;
+    } reply_source_t;
+    vector<reply_source_t> reply_sources;
+
+    // What the current turn changed, for save_turn()
+    //  turn_picks: the sent value set by each pick
+    //      (a turn can pick more than once, e.g. repeats)
+    //  name_changed: if find_name() set user_name
+    typedef pmr::vector<pair<const vector<bool> *, uint32_t>> turn_picks_t;
+    turn_picks_t turn_picks{&turn_arena};
+    bool name_changed = false;
+
+    // Prefilters
+    // Before a stage searches input_str for its keys, it checks
+    // the input's signature, made once per turn by sign_input().
+    // A key can only be a substring of input_str if every pair of
+    // neighbouring characters (bigram) in the key is also in
+    // input_str, so each key's bigrams are kept as a bloom filter.
+    // If the input is missing any of them, the key cannot match
+    // and its find() is skipped. Keys shorter than two characters
+    // have no bigrams and are always searched.
+    typedef struct bigrams_t
+    {
+        uint64_t bits[2];
+    } bigrams_t;
+
+    //  bigrams: bigrams of input_str
+    //  question: input_str contains '?'
+    //  words: number of words in input
+    typedef struct signature_t
+    {
+        bigrams_t bigrams;
+        bool question;
+        unsigned int words;
+    } signature_t;
+    signature_t signature = {};
+
+    // Stage signatures, filled in by build_tables()
+    // A stage can only give an output if input_str has one of
+    // its keys, or if the input's number of words is from
+    // min_words to max_words (for stages that answer some inputs
+    // by their words alone). keys holds one bigram of each key
+    // the stage searches input_str for, so if the input has none
+    // of them, choose_output() skips the whole stage (see
+    // stage_may_fire()). Ranks 1 and 2 have no signature: Rank 1
+    // answers "hi" or a repeated word of any input, and Rank 2
+    // any input with a verb.
+    typedef struct stage_signature_t
+    {
+        bigrams_t keys;
+        unsigned int min_words;
+        unsigned int max_words;
+    } stage_signature_t;
+    stage_signature_t rank_0_signature = {};
+    stage_signature_t rank_3_signature = {};
+    stage_signature_t rank_4_signature = {};
+
+    // Bigrams of each key, filled in by build_tables()
+    //  rank_1_bigrams[i][j]: key j of rank_1_keychains[i]
+    //  rank_3_bigrams[i][j]: key j of rank_3_keychains[i]
+    //  rank_3_common[i]: bigrams that every key of rank_3_keychains[i] has
+    vector<bigrams_t> hakuna_bigrams;
+    vector<vector<bigrams_t>> rank_1_bigrams;
+    vector<bigrams_t> alike_bigrams;
+    vector<vector<bigrams_t>> rank_3_bigrams;
+    vector<bigrams_t> rank_3_common;
+    vector<bigrams_t> negative_bigrams;
+
+    // Keys that may match with typos, numbered by build_tables()
+    //  fuzzy_keys: the keys below, indexed by bigram by build_fuzzy()
+    //  rank_1_fuzzy[i] + j: number of key j of rank_1_keychains[i]
+    //  rank_3_fuzzy[i] + j: number of key j of rank_3_keychains[i]
+    //  alike_fuzzy + i, negative_fuzzy + i: numbers of alikes.in[i]
+    //      and negatives.in[i]
+    //  verb_fuzzy[set] + key: number of verb_sets[set][key]
+    //  fuzzy_hits[n]: bigrams key n shares with input_str, counted
+    //      by begin_fuzzy_pass()
+    //  fuzzy_found[n]: mistakes key n has in input_str (see
+    //      fuzzy_search()), or fuzzy_unknown until has_key() first
+    //      needs it in a turn
+    fuzzy_index_t fuzzy_keys;
+    vector<unsigned int> rank_1_fuzzy;
+    vector<unsigned int> rank_3_fuzzy;
+    unsigned int alike_fuzzy = 0;
+    unsigned int negative_fuzzy = 0;
+    vector<unsigned int> verb_fuzzy;
+    vector<uint8_t> fuzzy_hits;
+    vector<uint8_t> fuzzy_found;
+    static constexpr uint8_t fuzzy_unknown = 255;
+
     // Rank 3 Keys:
     //  Various keywords and their outputs
     keychain_t because = {{"because", "my reasoning is", "my reason is"}, {"That's a fair reason.", "Good point.", "That makes sense!", "Ooh, very true.", "Haha, that works.", "Sounds like you've thought this through!"}, {0}};
@@ -175,7 +373,7 @@ private:
     // Function: edit_input()
     // Splits input into words, which become lowercase
     // and are added to the vector called input.
-    void edit_input(vector<string> &input, string &input_str)
+    void edit_input(scratch_words &input, string &input_str)
     {
         unsigned int i = 0;
         input.push_back("");
@@ -212,14 +410,23 @@ private:
 
     // Function: find_name_help()
     // A helper function for find_name()
-    void find_name_help(string my_name_is, string is)
+    void find_name_help(string_view my_name_is, string_view is)
     {
         if (input_str.find(my_name_is) != string::npos)
         {
-            vector<string>::iterator it = find(input.begin(), input.end(), is); // I learned this method from
-            int index = distance(input.begin(), it);                            // GeeksforGeeks article "How to find index
-            user_name = input[index + 1];                                       // of a given element in a Vector in C++"
-            output = "Nice to know, " + user_name + "!";
+            scratch_words::iterator it = find(input.begin(), input.end(), is); // I learned this method from
+            unsigned int index = distance(input.begin(), it);                  // GeeksforGeeks article "How to find index
+            if (index + 1 >= input.size())                                     // of a given element in a Vector in C++"
+                return; // No name after "is" (e.g. "my name is" at the end)
+            if (analyze_only)
+            {
+                reply = "-";
+                return;
+            }
+            user_name = input[index + 1];
+            name_changed = true;
+            output.assign("Nice to know, ").append(user_name).append("!");
+            reply = output;
         }
     }
 
@@ -260,55 +467,110 @@ private:
     // Function: rand_out() for keychain_t
     // Picks a random output if it hasn't been
     // sent before. Changes chosen output's
-    // sent value to true.
-    string rand_out(keychain_t &keychain)
+    // sent value to true. Returns a view of
+    // the stored output rather than a copy.
+    string_view rand_out(keychain_t &keychain)
     {
+        if (analyze_only)
+            return "-";
+
         prep_sent(keychain);
 
         unsigned int i = rand() % keychain.out.size();
         while (keychain.sent[i] == true)
             i = rand() % keychain.out.size();
         keychain.sent[i] = true;
+        turn_picks.push_back({&keychain.sent, i});
+        trace.reply = i;
         return keychain.out[i];
     }
 
     // Function: rand_out() for half_keychain_t
     // Same method as rand_out() for keychain_t
-    string rand_out(half_keychain_t &keychain)
+    string_view rand_out(half_keychain_t &keychain)
     {
+        if (analyze_only)
+            return "-";
+
         prep_sent(keychain);
 
         unsigned int i = rand() % keychain.out.size();
         while (keychain.sent[i] == 1)
             i = rand() % keychain.out.size();
         keychain.sent[i] = 1;
+        turn_picks.push_back({&keychain.sent, i});
+        trace.reply = i;
         return keychain.out[i];
     }
 
     // Function: rand_out() for vector<string>
     // Returns random output from vector
-    string rand_out(vector<string> &options)
+    string_view rand_out(const vector<string> &options)
     {
-        return options[rand() % options.size()];
+        if (analyze_only)
+            return "-";
+
+        unsigned int i = rand() % options.size();
+        trace.reply = i;
+        return options[i];
     }
 
-    // Function: find_subject_pronoun()
-    // Finds subject pronoun if in input
-    // If not, returns "";
-    string find_subject_pronoun()
+    // Function: rand_out() for scratch_words
+    // Same method as rand_out() for vector<string>,
+    // but options are built for this turn only, so
+    // the chosen one is copied into output.
+    string_view rand_out(const scratch_words &options)
     {
-        string result = "";
-        for (string input_word : input)
-        {
-            for (unsigned int i = 0; i < subj_pros.in.size(); i++)
-            {
-                if (input_word == subj_pros.in[i])
-                {
-                    result = subj_pros.out[i];
-                    return result;
-                }
-            }
-        }
+        if (analyze_only)
+            return "-";
+
+        unsigned int i = rand() % options.size();
+        trace.reply = i;
+        output.assign(options[i]);
+        return output;
+    }
+
+    // Function: cat()
+    // Joins pieces into one string that lives
+    // in the per-turn arena. Used instead of
+    // operator+ so that building replies does
+    // not make a temporary for every "+".
+    scratch_string cat(initializer_list<string_view> pieces)
+    {
+        size_t size = 0;
+        for (string_view piece : pieces)
+            size += piece.size();
+
+        scratch_string result(&turn_arena);
+        result.reserve(size);
+        for (string_view piece : pieces)
+            result.append(piece);
+        return result;
+    }
+
+    // Function: trace_match()
+    // Records in the trace which key of which
+    // keychain matched (see trace_record_t)
+    void trace_match(uint8_t branch, int keychain, int key)
+    {
+        trace.branch = branch;
+        trace.keychain = keychain;
+        trace.key = key;
+    }
+
+    // Function: run_stage()
+    // Runs one stage of get_reply(), timing it for
+    // the trace (a stage run again in the fuzzy pass
+    // adds to its time). If the stage gives an
+    // output, it is recorded as the stage that chose
+    // the reply.
+    string_view run_stage(trace_stage stage, string_view (Chatbot::*stage_help)())
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        string_view result = (this->*stage_help)();
+        trace_add_ns(trace.stage_ns[stage], chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        if (result != "")
+            trace.stage = stage;
         return result;
     }
 
@@ -316,9 +578,9 @@ private:
     // Returns an appropriate output if
     // the input string is empty (has no
     // words).
-    string empty_help()
+    string_view empty_help()
     {
-        string result = "";
+        string_view result = "";
         if (input.size() == 0 || input[0] == "")
             return rand_out(empty_out);
         return result;
@@ -332,9 +594,12 @@ private:
     // (Responding to abnormal repeats
     // will make the bot more realistic by
     // imitating basic memory.)
-    string repeat_help()
+    string_view repeat_help()
     {
-        string result = "";
+        string_view result = "";
+        if (analyze_only) // classify() has no history
+            return result;
+
         unsigned int reps = 0;
         reps = total_reps();
 
@@ -358,7 +623,7 @@ private:
     int total_reps()
     {
         unsigned int reps = 0;
-        reps = count(past_inputs.begin(), past_inputs.end(), input_str);
+        reps = count(past_inputs.begin(), past_inputs.end(), string_view(input_str));
         return reps;
     }
 
@@ -371,25 +636,27 @@ private:
     // returns the next line of the song.
     // If the input is just "hakuna", reply
     // "matata!"
-    string rank_0_help()
+    string_view rank_0_help()
     {
-        string result = "";
+        string_view result = "";
 
         if (input.size() == 1 && input[0] == "hakuna")
         {
+            trace_match(1, -1, -1);
             result = "matata!";
             return result;
         }
 
         for (unsigned int i = 0; i < hakuna.size(); i++)
-            if (input_str.find(hakuna[i]) != string::npos)
+            if (may_contain(hakuna_bigrams[i]) && input_str.find(hakuna[i]) != string::npos)
             {
+                trace_match(0, -1, i);
                 result = hakuna[i + 1];
 
                 // Since lines 1 and 3 of the song are both
                 // "hakuna matata", our corresponding output
                 // should alternate between lines 2 and 4.
-                if (i == 0)
+                if (i == 0 && !analyze_only)
                 {
                     if (wonderful_phrase_sent == 1)
                     {
@@ -399,7 +666,10 @@ private:
                     else
                         wonderful_phrase_sent = 1;
                 }
-                return result + "!";
+                if (analyze_only)
+                    return result;
+                output.assign(result).append("!");
+                return output;
             }
         return result;
     }
@@ -409,31 +679,69 @@ private:
     // "hi", "what's my name", and "?". Also
     // responds to inputs regarding similarity
     // between the chatbot and something else.
-    string rank_1_help()
+    // The trace branch says which of these
+    // (in order, from 0) gave the output.
+    string_view rank_1_help()
     {
         // Although they are greetings, "hi", "hey",
         // and "yo" are in Rank 1 not Rank 3 because the
         // Rank 3 method uses string::find, which would
         // read "this" and say that we found "hi".
         if ((input[0] == "hi") || (input[0] == "hey" || input[0] == "yo"))
+        {
+            trace_match(0, -1, -1);
             return rand_out(hellos);
+        }
 
         // Respond to "what's my name?"
-        if (input_str.find("what's my name?") != string::npos || input_str.find("what is my name?") != string::npos)
-            return "Your name is " + user_name;
+        if (signature.question && (input_str.find("what's my name?") != string::npos || input_str.find("what is my name?") != string::npos))
+        {
+            trace_match(1, -1, -1);
+            output.assign("Your name is ").append(user_name);
+            return output;
+        }
 
         // Respond to questions greater than two words
-        if (input.size() > 2 && input_str.find("?") != string::npos)
+        if (input.size() > 2 && signature.question)
         {
-            for (keychain_t keychain : rank_1_keychains)
+            // Keychains are bound by reference to avoid
+            // copying them every turn. Their sent values
+            // were never kept between turns (each turn used
+            // a fresh copy), so pick straight from "out".
+            // Questions never go past Rank 1, so with typos
+            // allowed the keys are tried again here with one
+            // mistake, then two, before the misc output
+            bool was_fuzzy_pass = fuzzy_pass;
+            unsigned int was_fuzzy_level = fuzzy_level;
+            for (;;)
             {
-                for (string key : keychain.in)
+                for (unsigned int i = 0; i < rank_1_keychains.size(); i++)
                 {
-                    if (input_str.find(key) != string::npos) // If input matches a key,
-                        return rand_out(keychain);           // return an appropriate output
+                    const keychain_t &keychain = rank_1_keychains[i];
+                    for (unsigned int j = 0; j < keychain.in.size(); j++)
+                    {
+                        if (has_key(rank_1_bigrams[i][j], keychain.in[j], rank_1_fuzzy[i] + j)) // If input matches a key,
+                        {
+                            if (fuzzy_pass)
+                                trace.flags |= TRACE_FUZZY;
+                            fuzzy_pass = was_fuzzy_pass;
+                            fuzzy_level = was_fuzzy_level;
+                            trace_match(2, i, j);
+                            return rand_out(keychain.out); // return an appropriate output
+                        }
+                    }
                 }
+                if (!fuzzy || was_fuzzy_pass || fuzzy_level == fuzzy_max_errors)
+                    break;
+                if (!fuzzy_pass)
+                    begin_fuzzy_pass();
+                else
+                    fuzzy_level++;
             }
+            fuzzy_pass = was_fuzzy_pass;
+            fuzzy_level = was_fuzzy_level;
 
+            trace_match(3, -1, -1);
             return rand_out(q_misc_out); // Else return a misc output designed to answer questions
         }
 
@@ -441,34 +749,44 @@ private:
         // found, return an appropriate output
         // If no "you" is found, don't do anything
         // because we will deal with that in Rank 2
-        for (string alike : alikes.in)
+        for (unsigned int i = 0; i < alikes.in.size(); i++)
         {
-            if (input_str.find(alike) != string::npos)
+            if (has_key(alike_bigrams[i], alikes.in[i], alike_fuzzy + i))
             {
                 if (find(input.begin(), input.end(), "you") != input.end())
+                {
+                    trace_match(4, -1, i);
                     return rand_out(alike_bot);
+                }
             }
         }
 
         // Respond to inputs with the same word
         // repeated twice. E.g. "walk the walk"
         // is very general and thus a general
-        // reply is appropriate.
-        for (unsigned int i = 0; i < input.size(); i++)
+        // reply is appropriate. (A word can only
+        // be repeated if there are two words.)
+        for (unsigned int i = 0; input.size() > 1 && i < input.size(); i++)
         {
             // Ignore repeated determiners, like "the" and "some"
-            if (find(determiners.begin(), determiners.end(), input[i]) != determiners.end())
+            if (find(determiners.begin(), determiners.end(), string_view(input[i])) != determiners.end())
                 continue;
             // Ignore subject pronouns
-            if (find(subj_pros.in.begin(), subj_pros.in.end(), input[i]) != subj_pros.in.end())
+            if (find(subj_pros.in.begin(), subj_pros.in.end(), string_view(input[i])) != subj_pros.in.end())
                 continue;
             if (count(input.begin(), input.end(), input[i]) > 1)
+            {
+                trace_match(5, -1, i);
                 return rand_out(misc_out);
+            }
         }
 
         // Respond to "going"
         if (find(input.begin(), input.end(), "going") != input.end())
+        {
+            trace_match(6, -1, -1);
             return rand_out(going);
+        }
 
         return "";
     }
@@ -482,47 +800,64 @@ private:
     // contains "not" or else we run the risk
     // of responding to "I am not attractive"
     // with "Awesome!")
-    string rank_3_help()
+    // The trace branch is 0 for a reply from the
+    // keychain itself, 1 for about_bot_outs, 2 for
+    // about_user_outs and 3 for a negated adjective.
+    string_view rank_3_help()
     {
-        subject = find_subject_pronoun();
-        for (unsigned int i = 0; i < rank_3_keychains.size(); i++)
+        subject = "";
+        if (analysis.subject_id >= 0)
+            subject = subj_pros.out[analysis.subject_id];
+
+        // If rank_3_keychains[i] is neg_emos, neg_adjs, or
+        // pos_adjs, check if negative is found
+        // (only used for i <= 2, and the same for each)
+        bool neg_found = false;
+        for (unsigned int k = 0; k < negatives.in.size(); k++)
         {
-            // If rank_3_keychains[i] is neg_emos, neg_adjs, or
-            // pos_adjs, check if negative is found
-            bool neg_found = false;
-            if (i <= 2)
+            if (has_key(negative_bigrams[k], negatives.in[k], negative_fuzzy + k))
             {
-                for (string neg : negatives.in)
-                {
-                    if (input_str.find(neg) != string::npos)
-                    {
-                        neg_found = true;
-                        break;
-                    }
-                }
+                neg_found = true;
+                break;
             }
+        }
+
+        for (unsigned int i = 0; i < rank_3_keychains.size(); i++)
+        {
+            // Skip keychains whose keys all share a
+            // bigram that the input doesn't have
+            if (!fuzzy_pass && !may_contain(rank_3_common[i]))
+                continue;
 
             // For each key input in a keychain, check
             // if that key input is in input. If not, return "".
             // If so, then return an appropriate output.
-            for (string key : rank_3_keychains[i].in)
+            for (unsigned int j = 0; j < rank_3_keychains[i].in.size(); j++)
             {
-                if (input_str.find(key) != string::npos)
+                if (has_key(rank_3_bigrams[i][j], rank_3_keychains[i].in[j], rank_3_fuzzy[i] + j))
                 {
                     if (i != 0)
                     {
                         if (subject == "i")
+                        {
+                            trace_match(1, i, j);
                             return rand_out(about_bot_outs);
+                        }
                         else if (subject == "you")
+                        {
+                            trace_match(2, i, j);
                             return rand_out(about_user_outs);
+                        }
                     }
-                    if (neg_found == true)
+                    if (i <= 2 && neg_found == true)
                     {
+                        trace_match(3, i, j);
                         if (i == 2)
                             return rand_out(neg_adjs);
                         else
                             return rand_out(pos_adjs);
                     }
+                    trace_match(0, i, j);
                     return rand_out(rank_3_keychains[i]);
                 }
             }
@@ -534,103 +869,203 @@ private:
     // If input is a single word, respond appropriately
     // Inputs like "Ha!" should trigger outputs like
     // "Ha!" or "Why are you laughing?".
-    string rank_4_help()
+    // The trace branch is 0 for a keychain match
+    // and 1 for a reply built from the word (see
+    // echo_help()).
+    string_view rank_4_help()
     {
-        string result = "";
+        string_view result = "";
 
         if (input.size() == 1)
         {
-            for (keychain_t keychain : rank_4_keychains)
+            string_view word = input[0];
+            for (unsigned int k = 0; k < rank_4_keychains.size(); k++)
             {
+                keychain_t &keychain = rank_4_keychains[k];
                 for (unsigned int i = 0; i < keychain.in.size(); i++)
                 {
-                    if (input[0] == keychain.in[i])
+                    if (word == keychain.in[i] || (fuzzy_pass && fuzzy_compare(keychain.in[i], word) <= fuzzy_level))
                     {
+                        trace_match(0, k, i);
                         prep_sent(keychain);
                         result = rand_out(keychain.out);
                         return result;
                     }
                 }
             }
-            vector<string> options = {input[0] + "...?", "Um, what do you mean by \"" + input[0] + "\"?", input[0] + "? Like, " + input[0] + " what?", input[0] + ". Right.", input[0] + "..."};
-            result = rand_out(options);
+
+            // With typos allowed, choose_output() tries
+            // every key with typos before echoing
+            if (!fuzzy)
+                result = echo_help();
         }
         return result;
     }
 
-    // Function: find_verb()
-    // Sets verb, verb_pres, verb_ed,
-    // and verb_ing.
-    void find_verb()
+    // Function: echo_help()
+    // Responds to a single word that no
+    // key matched by echoing it back
+    string_view echo_help()
+    {
+        if (input.size() != 1)
+            return "";
+
+        string_view word = input[0];
+        trace_match(1, -1, -1);
+        if (analyze_only)
+            return "-";
+        scratch_words options(&turn_arena);
+        options = {cat({word, "...?"}), cat({"Um, what do you mean by \"", word, "\"?"}), cat({word, "? Like, ", word, " what?"}), cat({word, ". Right."}), cat({word, "..."})};
+        return rand_out(options);
+    }
+
+    // Function: analyze()
+    // Reads the input once and fills in analysis
+    // for Ranks 2 and 3. The words are scanned once
+    // for both the verb and the subject pronoun;
+    // each word is only compared with the verb
+    // keys in verb_keys_at for its first letter.
+    // input_str is scanned once for all the tense
+    // keys together: tense_before_at and tense_in_verb_at
+    // say which keys can start at each character, so
+    // we only compare those keys instead of running one
+    // find() per key.
+    void analyze()
     {
-        int current_verb_set;
-        for (string input_word : input)
+        analysis = {-1, -1, -1, -1, NONE, 0};
+
+        for (unsigned int w = 0; w < input.size(); w++)
         {
-            current_verb_set = -1;
-            for (vector<string> verb_set : verb_sets)
+            string_view word = input[w];
+
+            for (unsigned int i = 0; analysis.subject_id < 0 && i < subj_pros.in.size(); i++)
+                if (word == subj_pros.in[i])
+                    analysis.subject_id = i;
+
+            if (analysis.verb_word < 0 && word != "")
             {
-                current_verb_set++;
-                for (string verb_key : verb_set)
+                for (verb_ref_t ref : verb_keys_at[(unsigned char)word[0]])
                 {
-                    if (input_word.find(verb_key) == 0) // to avoid "hat" being mistakenly found in "that"
+                    // Verb keys must start the word, to avoid "hat"
+                    // being mistakenly found in "that"
+                    const string &verb_key = verb_sets[ref.set][ref.key];
+                    if (word.compare(0, verb_key.size(), verb_key) == 0)
                     {
-                        verb_pres = verb_key; // Make all of these
-                        verb_ed = verb_key;   // equal the verb key.
-                        verb_ing = verb_key;  // Next, we will edit them.
+                        analysis.verb_word = w;
+                        analysis.verb_set = ref.set;
+                        analysis.verb_key = ref.key;
+                        analysis.rest_begin = w + 1;
+                        break;
+                    }
+                }
+            }
 
-                        // E.g. "mop" becomes "mopp"
-                        if (current_verb_set == 0)
-                        {
-                            char last = verb_key[verb_key.size() - 1];
-                            verb_ed += last;
-                            verb_ing += last;
-                        }
+            if (analysis.subject_id >= 0 && analysis.verb_word >= 0)
+                break;
+        }
 
-                        // E.g. "despis" becomes "despise"
-                        if (current_verb_set == 2)
-                            verb_pres += "e";
+        // A simple way to determine tense
+        // is to search for two things:
+        // the before-verb and in-verb keys.
+        // E.g. "will have been <verb>-ing"
+        // is Future Perfect Progressive.
+        // So the before-verb is "will have been"
+        // and the in-verb is "ing".
+        uint32_t before_found = tense_before_always;
+        uint32_t in_verb_found = tense_in_verb_always;
+        for (unsigned int pos = 0; pos < input_str.size(); pos++)
+        {
+            unsigned char ch = input_str[pos];
+            uint32_t keys = tense_before_at[ch] & ~before_found;
+            for (unsigned int i = 0; keys != 0; i++, keys >>= 1)
+                if ((keys & 1) && input_str.compare(pos, tense_help.before[i].size(), tense_help.before[i]) == 0)
+                    before_found |= 1u << i;
+
+            keys = tense_in_verb_at[ch] & ~in_verb_found;
+            for (unsigned int i = 0; keys != 0; i++, keys >>= 1)
+                if ((keys & 1) && input_str.compare(pos, tense_help.in_verb[i].size(), tense_help.in_verb[i]) == 0)
+                    in_verb_found |= 1u << i;
+        }
 
-                        // E.g. "cr" becomes "cry"
-                        if (current_verb_set == 3)
-                            verb_pres += "y";
+        // The first tense whose keys are both found wins
+        uint32_t both_found = before_found & in_verb_found;
+        for (unsigned int i = 0; i < tense_help.tenses.size(); i++)
+        {
+            if (both_found & (1u << i))
+            {
+                analysis.input_tense = tense_help.tenses[i];
+                break;
+            }
+        }
+    }
 
-                        // Finally add "ed" and "ing"
-                        // E.g. "mopp" becomes "mopped" and "mopping"
-                        verb_ed += "ed";
-                        verb_ing += "ing";
+    // Function: find_fuzzy_verb()
+    // In the fuzzy pass, if no verb key starts
+    // a word, looks for one that does with up to
+    // fuzzy_level typos. Like analyze(), the first
+    // word wins, and then the first key.
+    void find_fuzzy_verb()
+    {
+        for (unsigned int set = 0; set < verb_sets.size(); set++)
+        {
+            for (unsigned int key = 0; key < verb_sets[set].size(); key++)
+            {
+                const string &verb_key = verb_sets[set][key];
+                if (!fuzzy_may_match(fuzzy_keys, fuzzy_hits, verb_fuzzy[set] + key))
+                    continue;
 
-                        // Store the actual input verb in verb variable
-                        verb = input_word;
-                        return;
+                unsigned int errors = min(fuzzy_errors(verb_key.size()), fuzzy_level);
+                fuzzy_pattern_t pattern = fuzzy_pattern(verb_key);
+                for (int w = 0; w < int(input.size()) && (analysis.verb_word < 0 || w < analysis.verb_word); w++)
+                {
+                    if (fuzzy_distance(pattern, input[w], errors, FUZZY_ANYWHERE) <= errors)
+                    {
+                        analysis.verb_word = w;
+                        analysis.verb_set = set;
+                        analysis.verb_key = key;
+                        analysis.rest_begin = w + 1;
+                        break;
                     }
                 }
             }
         }
-        return;
     }
 
-    // Function: find_tense()
-    // A simple way to determine tense
-    // is to search for two things:
-    // the before-verb and in-verb keys.
-    // E.g. "will have been <verb>-ing"
-    // is Future Perfect Progressive.
-    // So the before-verb is "will have been"
-    // and the in-verb is "ing".
-    tense find_tense()
+    // Function: find_verb()
+    // Sets verb, verb_pres, verb_ed,
+    // and verb_ing from the verb key
+    // found by analyze().
+    void find_verb()
     {
-        for (unsigned int i = 0; i < tense_help.tenses.size(); i++)
+        const string &verb_key = verb_sets[analysis.verb_set][analysis.verb_key];
+
+        verb_pres = verb_key; // Make all of these
+        verb_ed = verb_key;   // equal the verb key.
+        verb_ing = verb_key;  // Next, we will edit them.
+
+        // E.g. "mop" becomes "mopp"
+        if (analysis.verb_set == 0)
         {
-            // if the before-verb key is found
-            if (input_str.find(tense_help.before[i]) != string::npos)
-            {
-                // if the in-verb key is also found
-                if (input_str.find(tense_help.in_verb[i]) != string::npos)
-                    // return the corresponding tense
-                    return tense_help.tenses[i];
-            }
+            char last = verb_key[verb_key.size() - 1];
+            verb_ed += last;
+            verb_ing += last;
         }
-        return NONE;
+
+        // E.g. "despis" becomes "despise"
+        if (analysis.verb_set == 2)
+            verb_pres += "e";
+
+        // E.g. "cr" becomes "cry"
+        if (analysis.verb_set == 3)
+            verb_pres += "y";
+
+        // Finally add "ed" and "ing"
+        // E.g. "mopp" becomes "mopped" and "mopping"
+        verb_ed += "ed";
+        verb_ing += "ing";
+
+        // Store the actual input verb in verb variable
+        verb = input[analysis.verb_word];
     }
 
     // Function: find_be()
@@ -641,32 +1076,35 @@ private:
     {
         if (input_tense == PAST_PERF || input_tense == PAST_PERFPRO)
             return "had";
-        if (subject == "i")
+
+        switch (subj_persons[analysis.subject_id])
         {
+        case FIRST_PERSON:
             if (input_tense == PAST_PRO)
                 return "was";
             if (input_tense == PRES_PRO)
                 return "am";
             if (input_tense == PRES_PERF || input_tense == PRES_PERFPRO)
                 return "have";
-        }
-        if (subject == "you" || subject == "they" || subject == "we")
-        {
+            break;
+        case PLURAL_PERSON:
             if (input_tense == PAST_PRO)
                 return "were";
             if (input_tense == PRES_PRO)
                 return "are";
             if (input_tense == PRES_PERF || input_tense == PRES_PERFPRO)
                 return "have";
-        }
-        if (subject == "she" || subject == "he" || subject == "it")
-        {
+            break;
+        case THIRD_PERSON:
             if (input_tense == PAST_PRO)
                 return "was";
             if (input_tense == PRES_PRO)
                 return "is";
             if (input_tense == PRES_PERF || input_tense == PRES_PERFPRO)
                 return "has";
+            break;
+        default:
+            break;
         }
         return "";
     }
@@ -677,9 +1115,7 @@ private:
     // I need to find rest.
     void find_rest()
     {
-        vector<string>::iterator it = find(input.begin(), input.end(), verb);
-        int index = distance(input.begin(), it);
-        for (unsigned int i = index + 1; i < input.size(); i++)
+        for (unsigned int i = analysis.rest_begin; i < input.size(); i++)
         {
             rest += " ";
             if (input[i] == "me")
@@ -699,63 +1135,80 @@ private:
         }
     }
 
-    string rank_2_help()
+    // Function: rank_2_help()
+    // Responds to verbs, using the verb,
+    // tense and subject found by analyze().
+    // (rank_3_help() reuses the analysis.)
+    string_view rank_2_help()
     {
-        find_verb();
-        if (verb == "")
+        // In the fuzzy pass, the analysis from the
+        // exact pass only lacks a verb to answer
+        if (!fuzzy_pass)
+            analyze();
+        else if (analysis.verb_word < 0 && analysis.input_tense != NONE && analysis.subject_id >= 0)
+            find_fuzzy_verb();
+        else
             return "";
 
-        input_tense = find_tense();
-        if (input_tense == NONE)
+        if (analysis.verb_word < 0)
             return "";
 
-        subject = find_subject_pronoun();
-        if (subject == "")
+        if (analysis.input_tense == NONE)
             return "";
 
+        if (analysis.subject_id < 0)
+            return "";
+
+        trace_match(0, analysis.verb_set, analysis.verb_key);
+        if (analyze_only)
+            return "-";
+        find_verb();
+        input_tense = analysis.input_tense;
+        subject = subj_pros.out[analysis.subject_id];
+
         string be = find_be();
 
         find_rest();
 
-        vector<string> verb_options;
+        scratch_words verb_options(&turn_arena);
 
         switch (input_tense)
         {
         case FUT_PERFPRO:
-            verb_options = {"Why will " + subject + " have been " + verb + "?", verb + "? Why will " + subject + " have been doing that?", verb_ing + ", right. Cool beans.", "Whatever, " + subject + " may need to reevaluate some priorities."};
+            verb_options = {cat({"Why will ", subject, " have been ", verb, "?"}), cat({verb, "? Why will ", subject, " have been doing that?"}), cat({verb_ing, ", right. Cool beans."}), cat({"Whatever, ", subject, " may need to reevaluate some priorities."})};
             break;
         case FUT_PERF:
-            verb_options = {"Why will " + subject + " have " + verb_ed + "?", verb + "? Why will " + subject + " have done that?", "If you want to survive, you'd better run. Oh, sorry, did I say something weird?", subject + ", you say? Meh."};
+            verb_options = {cat({"Why will ", subject, " have ", verb_ed, "?"}), cat({verb, "? Why will ", subject, " have done that?"}), cat({"If you want to survive, you'd better run. Oh, sorry, did I say something weird?"}), cat({subject, ", you say? Meh."})};
             break;
         case FUT_PRO:
-            verb_options = {"Why will " + subject + " be " + verb_ing + "?", verb + "? Why will " + subject + " be doing that?", "Get a life. Like, " + subject + "shouldn't do that when there are so many better things.", verb_ing + " is so last season, and it's not coming back."};
+            verb_options = {cat({"Why will ", subject, " be ", verb_ing, "?"}), cat({verb, "? Why will ", subject, " be doing that?"}), cat({"Get a life. Like, ", subject, "shouldn't do that when there are so many better things."}), cat({verb_ing, " is so last season, and it's not coming back."})};
             break;
         case FUT_SIMP:
-            verb_options = {"Why will " + subject + " " + verb_pres + "?", verb_ing + ", huh.", subject + " will? Got a reason?", "Why do you say that?"};
+            verb_options = {cat({"Why will ", subject, " ", verb_pres, "?"}), cat({verb_ing, ", huh."}), cat({subject, " will? Got a reason?"}), cat({"Why do you say that?"})};
             break;
         case PRES_PERFPRO:
-            verb_options = {"Why " + be + " " + subject + " been " + verb_ing + "?", verb + "? Why?", "Sure, " + verb_ing + ", I get it. Keep going.", "What do you mean?"};
+            verb_options = {cat({"Why ", be, " ", subject, " been ", verb_ing, "?"}), cat({verb, "? Why?"}), cat({"Sure, ", verb_ing, ", I get it. Keep going."}), cat({"What do you mean?"})};
             break;
         case PRES_PERF:
-            verb_options = {"Why " + be + " " + subject + " " + verb + "?", verb + "? Why will " + subject + "-- nevermind, whatever.", subject + " should get a better hobby.", "...Sounds like a totally wicked time."};
+            verb_options = {cat({"Why ", be, " ", subject, " ", verb, "?"}), cat({verb, "? Why will ", subject, "-- nevermind, whatever."}), cat({subject, " should get a better hobby."}), cat({"...Sounds like a totally wicked time."})};
             break;
         case PRES_PRO:
-            verb_options = {"Why " + be + " " + subject + " " + verb + "?", verb + "? Why " + be + " " + subject + " doing that?", subject + " " + be + " " + verb + rest + "? Elaborate.", "What do you mean?"};
+            verb_options = {cat({"Why ", be, " ", subject, " ", verb, "?"}), cat({verb, "? Why ", be, " ", subject, " doing that?"}), cat({subject, " ", be, " ", verb, rest, "? Elaborate."}), cat({"What do you mean?"})};
             break;
         case PRES_SIMP:
-            verb_options = {"Why " + be + " " + subject + " " + verb + "?", verb + "? Why " + be + " " + subject + " doing that?", "Uh, what? Sounds like a pain, to be honest.", "What do you mean?"};
+            verb_options = {cat({"Why ", be, " ", subject, " ", verb, "?"}), cat({verb, "? Why ", be, " ", subject, " doing that?"}), cat({"Uh, what? Sounds like a pain, to be honest."}), cat({"What do you mean?"})};
             break;
         case PAST_PERFPRO:
-            verb_options = {"Why " + be + " " + subject + " been " + verb + "?", "These winds are crazy. The winds of life, I mean. I think we should stop talking about this.", "Might not be a good idea.", subject + " what? What an interesting being."};
+            verb_options = {cat({"Why ", be, " ", subject, " been ", verb, "?"}), cat({"These winds are crazy. The winds of life, I mean. I think we should stop talking about this."}), cat({"Might not be a good idea."}), cat({subject, " what? What an interesting being."})};
             break;
         case PAST_PERF:
-            verb_options = {"Why " + be + " " + subject + " " + verb_ed + rest + "?", verb + "? Why, though?", "Keep going.", "Right."};
+            verb_options = {cat({"Why ", be, " ", subject, " ", verb_ed, rest, "?"}), cat({verb, "? Why, though?"}), cat({"Keep going."}), cat({"Right."})};
             break;
         case PAST_PRO:
-            verb_options = {subject + " " + verb + rest + "?", verb + "? Why would " + subject + " do that?", "Dude, whatevs.", "Wanna switch topics?"};
+            verb_options = {cat({subject, " ", verb, rest, "?"}), cat({verb, "? Why would ", subject, " do that?"}), cat({"Dude, whatevs."}), cat({"Wanna switch topics?"})};
             break;
         case PAST_SIMP:
-            verb_options = {"Why did " + subject + " " + verb_pres + rest + "?", verb + "? Why would " + subject + " do that?"};
+            verb_options = {cat({"Why did ", subject, " ", verb_pres, rest, "?"}), cat({verb, "? Why would ", subject, " do that?"})};
             break;
         default:
             break;
@@ -763,33 +1216,417 @@ private:
         return rand_out(verb_options);
     }
 
+    // Function: bigrams_of()
+    // Returns the bloom filter of the bigrams in text
+    static bigrams_t bigrams_of(string_view text)
+    {
+        bigrams_t result = {};
+        for (size_t i = 1; i < text.size(); i++)
+        {
+            unsigned int hash = ((unsigned char)text[i - 1] * 31u + (unsigned char)text[i]) & 127;
+            result.bits[hash >> 6] |= uint64_t(1) << (hash & 63);
+        }
+        return result;
+    }
+
+    // Function: may_contain()
+    // Returns false if the input cannot contain a key
+    // with the given bigrams. True means it might.
+    bool may_contain(const bigrams_t &key) const
+    {
+        return ((key.bits[0] & ~signature.bigrams.bits[0]) | (key.bits[1] & ~signature.bigrams.bits[1])) == 0;
+    }
+
+    // Function: sign_stage()
+    // Sets stage.keys to one bigram of each key,
+    // using one that is already there if the key
+    // has it, so few bits are set. A key without
+    // bigrams can't be ruled out, so the stage
+    // then always runs.
+    static void sign_stage(stage_signature_t &stage, const vector<bigrams_t> &keys)
+    {
+        for (const bigrams_t &key : keys)
+        {
+            if ((key.bits[0] | key.bits[1]) == 0)
+            {
+                stage.min_words = 0;
+                stage.max_words = UINT_MAX;
+            }
+            else if (((key.bits[0] & stage.keys.bits[0]) | (key.bits[1] & stage.keys.bits[1])) == 0)
+            {
+                // Add the key's lowest bigram bit
+                int half = key.bits[0] != 0 ? 0 : 1;
+                stage.keys.bits[half] |= key.bits[half] & -key.bits[half];
+            }
+        }
+    }
+
+    // Function: stage_may_fire()
+    // Returns false if the input has none of the
+    // stage's keys and the wrong number of words for
+    // it, so the stage can't give an output. In the
+    // fuzzy pass keys may be found with typos, so a
+    // stage with keys always may.
+    bool stage_may_fire(const stage_signature_t &stage) const
+    {
+        if (signature.words >= stage.min_words && signature.words <= stage.max_words)
+            return true;
+        if (fuzzy_pass)
+            return (stage.keys.bits[0] | stage.keys.bits[1]) != 0;
+        return ((stage.keys.bits[0] & signature.bigrams.bits[0]) | (stage.keys.bits[1] & signature.bigrams.bits[1])) != 0;
+    }
+
+    // Function: has_key()
+    // Checks if input_str contains key, checking
+    // the key's bigrams against the signature
+    // first. In the fuzzy pass, the key may also
+    // be found as whole words with up to
+    // fuzzy_level typos, if key number (see
+    // build_fuzzy()) passes the bigram filter.
+    // Each key is only searched for once a turn.
+    bool has_key(const bigrams_t &bigrams, const string &key, unsigned int number)
+    {
+        if (may_contain(bigrams) && input_str.find(key) != string::npos)
+            return true;
+        if (!fuzzy_pass || !fuzzy_may_match(fuzzy_keys, fuzzy_hits, number))
+            return false;
+        if (fuzzy_found[number] == fuzzy_unknown)
+            fuzzy_found[number] = fuzzy_search(key, input_str);
+        return fuzzy_found[number] <= fuzzy_level;
+    }
+
+    // Function: begin_fuzzy_pass()
+    // Starts letting keys match with one typo
+    // (choose_output() then allows two), counting
+    // which keys the input may have
+    void begin_fuzzy_pass()
+    {
+        fuzzy_pairs_t pairs;
+        fuzzy_pass = true;
+        fuzzy_level = 1;
+        fuzzy_sign(input_str, pairs);
+        fuzzy_count(fuzzy_keys, pairs, fuzzy_hits);
+        fuzzy_found.assign(fuzzy_hits.size(), fuzzy_unknown);
+    }
+
+    // Function: build_fuzzy()
+    // Indexes the keys that may match with typos,
+    // in the order build_tables() numbered them
+    void build_fuzzy()
+    {
+        vector<string_view> keys;
+        for (const keychain_t &keychain : rank_1_keychains)
+            keys.insert(keys.end(), keychain.in.begin(), keychain.in.end());
+        keys.insert(keys.end(), alikes.in.begin(), alikes.in.end());
+        for (const keychain_t &keychain : rank_3_keychains)
+            keys.insert(keys.end(), keychain.in.begin(), keychain.in.end());
+        keys.insert(keys.end(), negatives.in.begin(), negatives.in.end());
+        for (const vector<string> &verb_set : verb_sets)
+            keys.insert(keys.end(), verb_set.begin(), verb_set.end());
+        fuzzy_build(keys, fuzzy_keys);
+    }
+
+    // Function: sign_input()
+    // Makes the signature of the current input
+    void sign_input()
+    {
+        signature.bigrams = bigrams_of(input_str);
+        signature.question = input_str.find('?') != string::npos;
+        signature.words = input.size();
+    }
+
+    // Function: build_tables()
+    // Fills in the lookup tables used by analyze()
+    // and the prefilters
+    void build_tables()
+    {
+        for (unsigned int i = 0; i < tense_help.tenses.size(); i++)
+        {
+            const string &before = tense_help.before[i];
+            const string &in_verb = tense_help.in_verb[i];
+
+            if (before == "")
+                tense_before_always |= 1u << i;
+            else
+                tense_before_at[(unsigned char)before[0]] |= 1u << i;
+
+            if (in_verb == "")
+                tense_in_verb_always |= 1u << i;
+            else
+                tense_in_verb_at[(unsigned char)in_verb[0]] |= 1u << i;
+        }
+
+        for (unsigned int set = 0; set < verb_sets.size(); set++)
+            for (unsigned int key = 0; key < verb_sets[set].size(); key++)
+                verb_keys_at[(unsigned char)verb_sets[set][key][0]].push_back({uint16_t(set), uint16_t(key)});
+
+        for (const string &line : hakuna)
+            hakuna_bigrams.push_back(bigrams_of(line));
+        unsigned int fuzzy_number = 0;
+        for (const keychain_t &keychain : rank_1_keychains)
+        {
+            rank_1_fuzzy.push_back(fuzzy_number);
+            fuzzy_number += keychain.in.size();
+            rank_1_bigrams.emplace_back();
+            for (const string &key : keychain.in)
+                rank_1_bigrams.back().push_back(bigrams_of(key));
+        }
+        alike_fuzzy = fuzzy_number;
+        fuzzy_number += alikes.in.size();
+        for (const string &key : alikes.in)
+            alike_bigrams.push_back(bigrams_of(key));
+        for (const keychain_t &keychain : rank_3_keychains)
+        {
+            rank_3_fuzzy.push_back(fuzzy_number);
+            fuzzy_number += keychain.in.size();
+            rank_3_bigrams.emplace_back();
+            bigrams_t common = {{~uint64_t(0), ~uint64_t(0)}};
+            for (const string &key : keychain.in)
+            {
+                bigrams_t key_bigrams = bigrams_of(key);
+                rank_3_bigrams.back().push_back(key_bigrams);
+                common.bits[0] &= key_bigrams.bits[0];
+                common.bits[1] &= key_bigrams.bits[1];
+            }
+            rank_3_common.push_back(common);
+        }
+        negative_fuzzy = fuzzy_number;
+        fuzzy_number += negatives.in.size();
+        for (const string &key : negatives.in)
+            negative_bigrams.push_back(bigrams_of(key));
+        for (const vector<string> &verb_set : verb_sets)
+        {
+            verb_fuzzy.push_back(fuzzy_number);
+            fuzzy_number += verb_set.size();
+        }
+
+        // Rank 0 also answers the single word "hakuna", Rank 3
+        // only answers keys, and Rank 4 only single words
+        vector<bigrams_t> rank_3_keys;
+        for (const vector<bigrams_t> &keychain_bigrams : rank_3_bigrams)
+            rank_3_keys.insert(rank_3_keys.end(), keychain_bigrams.begin(), keychain_bigrams.end());
+        rank_0_signature = {{{0, 0}}, 1, 1};
+        sign_stage(rank_0_signature, hakuna_bigrams);
+        rank_3_signature = {{{0, 0}}, 1, 0};
+        sign_stage(rank_3_signature, rank_3_keys);
+        rank_4_signature = {{{0, 0}}, 1, 1};
+
+        for (const string &out : subj_pros.out)
+        {
+            if (out == "i")
+                subj_persons.push_back(FIRST_PERSON);
+            else if (out == "you" || out == "they" || out == "we")
+                subj_persons.push_back(PLURAL_PERSON);
+            else if (out == "she" || out == "he" || out == "it")
+                subj_persons.push_back(THIRD_PERSON);
+            else
+                subj_persons.push_back(NO_PERSON);
+        }
+    }
+
+    // Function: list_reply_sources()
+    // Fills in reply_sources. The order is part of
+    // the saved state format, so only add to the end.
+    // Also gives every sent vector its full size now
+    // rather than in prep_sent(), so that its size
+    // doesn't depend on which turns came before.
+    void list_reply_sources()
+    {
+        for (half_keychain_t *half_keychain : {&empty_out, &rep_out, &q_misc_out, &alike_bot, &going, &about_bot_outs, &about_user_outs, &misc_out})
+            reply_sources.push_back({&half_keychain->out, &half_keychain->sent});
+        for (keychain_t *keychain : {&hellos, &neg_adjs, &pos_adjs})
+            reply_sources.push_back({&keychain->out, &keychain->sent});
+        for (vector<keychain_t> *keychains : {&rank_1_keychains, &rank_3_keychains, &rank_4_keychains})
+            for (keychain_t &keychain : *keychains)
+                reply_sources.push_back({&keychain.out, &keychain.sent});
+        for (reply_source_t &source : reply_sources)
+            source.sent->resize(source.out->size(), false);
+    }
+
+    // Function: capitalize_outs()
+    // Capitalizes the first letter of every stored
+    // output once, so get_reply_view() can return
+    // them as they are.
+    void capitalize_outs()
+    {
+        for (reply_source_t &source : reply_sources)
+            for (string &option : *source.out)
+                if (option != "")
+                    option[0] = toupper(option[0]);
+    }
+
+    // Functions: put_number(), put_text(), get_number(), get_text()
+    // Write numbers and strings to a saved state
+    // and read them back. Numbers are 4 bytes,
+    // least significant first; strings are their
+    // length and then their characters. The get
+    // functions return false if state is too short.
+    static void put_number(string &state, uint32_t number)
+    {
+        for (int i = 0; i < 4; i++)
+            state.push_back(char((number >> (8 * i)) & 0xff));
+    }
+
+    static void put_text(string &state, string_view text)
+    {
+        put_number(state, text.size());
+        state.append(text);
+    }
+
+    static bool get_number(string_view &state, uint32_t &number)
+    {
+        if (state.size() < 4)
+            return false;
+        number = 0;
+        for (int i = 0; i < 4; i++)
+            number |= uint32_t((unsigned char)state[i]) << (8 * i);
+        state.remove_prefix(4);
+        return true;
+    }
+
+    static bool get_text(string_view &state, string_view &text)
+    {
+        uint32_t size;
+        if (!get_number(state, size) || state.size() < size)
+            return false;
+        text = state.substr(0, size);
+        state.remove_prefix(size);
+        return true;
+    }
+
     // Function: refresh()
-    // Resets variables that need to be reset
+    // Resets variables that need to be reset.
+    // Scratch containers are swapped out for
+    // empty ones before the arena is released,
+    // so none of them point into freed memory.
     void refresh()
     {
         input_str.clear();
         output.clear();
+        reply = "";
         subject.clear();
         object.clear();
         verb.clear();
         verb_pres.clear();
         verb_ed.clear();
         verb_ing.clear();
-        rest.clear();
+        scratch_string(&turn_arena).swap(rest);
         input_tense = NONE;
-        input.clear();
+        scratch_words(&turn_arena).swap(input);
+        turn_picks_t(&turn_arena).swap(turn_picks);
+        turn_arena.release();
+        analysis = {-1, -1, -1, -1, NONE, 0};
+        name_changed = false;
+
+        trace = {};
+        trace.session = session_id;
+        trace.turn = ++turns;
+        trace.stage = TRACE_MISC;
+        trace_match(0, -1, -1);
+        trace.reply = -1;
+    }
+
+    // Function: misc_help()
+    // Returns a miscellaneous output
+    string_view misc_help()
+    {
+        return rand_out(misc_out);
+    }
+
+    // Function: choose_output()
+    // Chooses an output depending on input.
+    // First checks if input is empty or
+    // is an abnormal repeat. If not,
+    // goes through different ranks of
+    // keywords. If an output is still
+    // unfound, pick an misc output.
+    void choose_output()
+    {
+        if (reply == "")
+            reply = run_stage(TRACE_EMPTY, &Chatbot::empty_help);
+
+        if (reply == "")
+            reply = run_stage(TRACE_REPEAT, &Chatbot::repeat_help);
+
+        // Rank 0: "Hakuna Matata"
+        if (reply == "" && stage_may_fire(rank_0_signature))
+            reply = run_stage(TRACE_RANK_0, &Chatbot::rank_0_help);
+
+        // Rank 1: High-ranking keywords
+        if (reply == "")
+            reply = run_stage(TRACE_RANK_1, &Chatbot::rank_1_help);
+
+        // Rank 2: Verb keywords
+        if (reply == "")
+            reply = run_stage(TRACE_RANK_2, &Chatbot::rank_2_help);
+
+        // Rank 3: Various other keywords
+        if (reply == "" && stage_may_fire(rank_3_signature))
+            reply = run_stage(TRACE_RANK_3, &Chatbot::rank_3_help);
+
+        // Rank 4: Single-word keywords
+        if (reply == "" && stage_may_fire(rank_4_signature))
+            reply = run_stage(TRACE_RANK_4, &Chatbot::rank_4_help);
+
+        // If typos are allowed and no key matched,
+        // run Ranks 1 to 4 again letting keys match
+        // with one typo, then with two, so the key
+        // with the fewest typos wins (and of those,
+        // the first in rank order). Then echo a
+        // single word.
+        if (reply == "" && fuzzy)
+        {
+            for (begin_fuzzy_pass(); reply == "" && fuzzy_level <= fuzzy_max_errors; fuzzy_level++)
+            {
+                reply = run_stage(TRACE_RANK_1, &Chatbot::rank_1_help);
+                if (reply == "")
+                    reply = run_stage(TRACE_RANK_2, &Chatbot::rank_2_help);
+                if (reply == "" && stage_may_fire(rank_3_signature))
+                    reply = run_stage(TRACE_RANK_3, &Chatbot::rank_3_help);
+                if (reply == "" && stage_may_fire(rank_4_signature))
+                    reply = run_stage(TRACE_RANK_4, &Chatbot::rank_4_help);
+            }
+            fuzzy_pass = false;
+            fuzzy_level = 0;
+
+            if (reply != "")
+                trace.flags |= TRACE_FUZZY;
+            else
+                reply = run_stage(TRACE_RANK_4, &Chatbot::echo_help);
+        }
+
+        // If no output has been chosen, use a miscellaneous one
+        if (reply == "")
+            reply = run_stage(TRACE_MISC, &Chatbot::misc_help);
     }
 
 public:
-    Chatbot(const string x)
+    // A Chatbot can't be copied or moved: its tables point
+    // into it, and its scratch data into its own arena. Hold
+    // one by pointer (e.g. unique_ptr) to pass it around, and
+    // copy a session with save_state() and load_state().
+    Chatbot(const string x, pmr::memory_resource *resource = pmr::get_default_resource())
+        : turn_arena(turn_buffer, sizeof(turn_buffer), resource),
+          user_name(resource),
+          output(resource),
+          past_inputs(resource)
     {
         bot_name = x;
         user_name = "your name";
         wonderful_phrase_sent = false;
         input_tense = NONE;
         rest = "";
+        session_id = trace_new_session();
+        turns = 0;
+        trace = {};
+        build_tables();
+        list_reply_sources();
+        capitalize_outs();
     }
 
+    Chatbot(const Chatbot &) = delete;
+    Chatbot &operator=(const Chatbot &) = delete;
+
     // Function: get_name()
     // Self-explanatory
     string get_name()
@@ -797,6 +1634,19 @@ public:
         return bot_name;
     }
 
+    // Function: set_fuzzy()
+    // If on, keys that don't match exactly may
+    // match with a typo or two (see chatbot_fuzzy.h),
+    // e.g. "helo" for "hello". Exact matches in any
+    // rank still come first, then the keys with the
+    // fewest typos. Off by default.
+    void set_fuzzy(bool on)
+    {
+        fuzzy = on;
+        if (on && fuzzy_keys.errors.empty())
+            build_fuzzy();
+    }
+
     // Function: tell()
     // Takes and stores user input.
     // Edits user input before
@@ -804,53 +1654,286 @@ public:
     // Also finds user name if mentioned.
     void tell(string user_input)
     {
-        past_inputs.push_back(input_str);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        past_inputs.emplace_back(input_str);
         refresh();
         input_str = user_input;
         edit_input(input, input_str);
+        sign_input();
         find_name();
+        trace_add_ns(trace.stage_ns[TRACE_TELL], chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        if (reply != "")
+            trace.stage = TRACE_TELL;
+    }
+
+    // Function: get_reply_view()
+    // Gets an output depending on input
+    // (see choose_output()) and capitalizes it.
+    // Stored outs are capitalized by the
+    // constructor, so most replies are a view
+    // of the stored text and are not copied.
+    // Only outputs that were built this turn
+    // (or that start in lowercase) are kept in
+    // output. The view is valid until the next
+    // call to tell().
+    // Each turn's trace record is written
+    // to the trace ring before returning.
+    string_view get_reply_view()
+    {
+        choose_output();
+
+        if (reply.data() != output.data() && islower((unsigned char)reply[0]))
+        {
+            output.assign(reply);
+            reply = output;
+        }
+        if (reply.data() == output.data())
+            output[0] = toupper(output[0]);
+
+        trace.tense = analysis.input_tense;
+        trace.subject = analysis.subject_id;
+        trace_write(trace);
+        return reply;
     }
 
     // Function: get_reply()
-    // Gets an output depending on input.
-    // First checks if input is empty or
-    // is an abnormal repeat. If not,
-    // goes through different ranks of
-    // keywords. If an output is still
-    // unfound, pick an misc output.
+    // Same as get_reply_view(), but returns a copy
     string get_reply()
     {
-        if (output == "")
-            output = empty_help();
+        return string(get_reply_view());
+    }
 
-        if (output == "")
-            output = repeat_help();
+    // Function: classify()
+    // Runs the stages of get_reply() on line
+    // without picking a reply or changing the
+    // session (name, sent outputs, past inputs),
+    // and returns the trace record saying which
+    // stage, keychain and key would answer it.
+    // Abnormal repeats are never found, since
+    // there is no history. Meant for a Chatbot
+    // that is only used for classify(), as it
+    // replaces the current input.
+    const trace_record_t &classify(string_view line)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        refresh();
+        input_str = line;
+        edit_input(input, input_str);
+        sign_input();
 
-        // Rank 0: "Hakuna Matata"
-        if (output == "")
-            output = rank_0_help();
+        analyze_only = true;
+        find_name();
+        trace_add_ns(trace.stage_ns[TRACE_TELL], chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        if (reply != "")
+            trace.stage = TRACE_TELL;
+        choose_output();
+        analyze_only = false;
+
+        trace.tense = analysis.input_tense;
+        trace.subject = analysis.subject_id;
+        return trace;
+    }
 
-        // Rank 1: High-ranking keywords
-        if (output == "")
-            output = rank_1_help();
+    // Function: key_text()
+    // Returns the key (or verb key, or hakuna
+    // line) named by a trace record, or "" if
+    // the record doesn't name one.
+    string key_text(const trace_record_t &record)
+    {
+        unsigned int keychain = record.keychain;
+        unsigned int key = record.key;
+        if (record.key < 0)
+            return "";
 
-        // Rank 2: Verb keywords
-        if (output == "")
-            output = rank_2_help();
+        switch (record.stage)
+        {
+        case TRACE_RANK_0:
+            if (key < hakuna.size())
+                return hakuna[key];
+            break;
+        case TRACE_RANK_1:
+            if (record.branch == 2 && keychain < rank_1_keychains.size() && key < rank_1_keychains[keychain].in.size())
+                return rank_1_keychains[keychain].in[key];
+            if (record.branch == 4 && key < alikes.in.size())
+                return alikes.in[key];
+            break;
+        case TRACE_RANK_2:
+            if (record.keychain >= 0 && keychain < verb_sets.size() && key < verb_sets[keychain].size())
+                return verb_sets[keychain][key];
+            break;
+        case TRACE_RANK_3:
+            if (record.keychain >= 0 && keychain < rank_3_keychains.size() && key < rank_3_keychains[keychain].in.size())
+                return rank_3_keychains[keychain].in[key];
+            break;
+        case TRACE_RANK_4:
+            if (record.keychain >= 0 && keychain < rank_4_keychains.size() && key < rank_4_keychains[keychain].in.size())
+                return rank_4_keychains[keychain].in[key];
+            break;
+        default:
+            break;
+        }
+        return "";
+    }
 
-        // Rank 3: Various other keywords
-        if (output == "")
-            output = rank_3_help();
+    // Function: save_state()
+    // Returns what this session remembers (user
+    // name, place in "Hakuna Matata", past inputs
+    // and which outputs were sent) as a string,
+    // so the session can be moved or restored
+    // with load_state().
+    string save_state()
+    {
+        string state;
+        put_number(state, 1); // Format version
+        put_text(state, user_name);
+        put_number(state, wonderful_phrase_sent);
+
+        // tell() adds the current input to
+        // past_inputs on the next turn, so it
+        // is saved with them
+        put_text(state, input_str);
+        put_number(state, past_inputs.size());
+        for (const pmr::string &past_input : past_inputs)
+            put_text(state, past_input);
+
+        put_number(state, reply_sources.size());
+        for (const reply_source_t &source : reply_sources)
+        {
+            put_number(state, source.sent->size());
+            for (bool sent : *source.sent)
+                state.push_back(sent);
+        }
+        return state;
+    }
 
-        // Rank 4: Single-word keywords
-        if (output == "")
-            output = rank_4_help();
+    // Function: load_state()
+    // Restores a session from save_state().
+    // Returns false (and changes nothing) if
+    // state is not a valid saved state.
+    bool load_state(string_view state)
+    {
+        uint32_t version, phrase_sent, count, size;
+        string_view name, last_input, text;
+
+        if (!get_number(state, version) || version != 1)
+            return false;
+        if (!get_text(state, name) || !get_number(state, phrase_sent) || !get_text(state, last_input))
+            return false;
+
+        pmr::vector<pmr::string> loaded_inputs(past_inputs.get_allocator());
+        if (!get_number(state, count))
+            return false;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (!get_text(state, text))
+                return false;
+            loaded_inputs.emplace_back(text);
+        }
 
-        // If no output has been chosen, use a miscellaneous one
-        if (output == "")
-            output = rand_out(misc_out);
+        vector<vector<bool>> loaded_sent;
+        if (!get_number(state, count) || count != reply_sources.size())
+            return false;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (!get_number(state, size) || state.size() < size || size > reply_sources[i].out->size())
+                return false;
+            loaded_sent.emplace_back(state.begin(), state.begin() + size);
+            state.remove_prefix(size);
+        }
 
-        output[0] = toupper(output[0]);
-        return output;
+        refresh();
+        user_name = name;
+        wonderful_phrase_sent = phrase_sent;
+        input_str = last_input;
+        past_inputs.swap(loaded_inputs);
+        for (uint32_t i = 0; i < count; i++)
+            *reply_sources[i].sent = loaded_sent[i];
+        return true;
     }
-};
\ No newline at end of file
+
+    // Function: history_size()
+    // Returns the number of past inputs, which
+    // grows by one each turn
+    size_t history_size() const
+    {
+        return past_inputs.size();
+    }
+
+    // Function: save_turn()
+    // Returns what the last turn (tell() and then
+    // get_reply()) changed: the input, the place in
+    // "Hakuna Matata", the user name if it was set
+    // and each output that was sent, by its index
+    // in reply_sources. Much smaller than
+    // save_state(), so it can be written every turn.
+    string save_turn()
+    {
+        string turn;
+        put_text(turn, input_str);
+        put_number(turn, wonderful_phrase_sent);
+        put_number(turn, name_changed);
+        if (name_changed)
+            put_text(turn, user_name);
+
+        put_number(turn, turn_picks.size());
+        for (const pair<const vector<bool> *, uint32_t> &pick : turn_picks)
+        {
+            uint32_t source = 0;
+            while (reply_sources[source].sent != pick.first)
+                source++;
+            put_number(turn, source);
+            put_number(turn, pick.second);
+        }
+        return turn;
+    }
+
+    // Function: replay_turn()
+    // Applies a turn from save_turn() to this
+    // session without choosing a reply, so replaying
+    // every turn since a save_state() gives back the
+    // same session. Returns false (and changes
+    // nothing) if turn is not a valid saved turn.
+    bool replay_turn(string_view turn)
+    {
+        uint32_t phrase_sent, changed, count;
+        string_view text, name;
+
+        if (!get_text(turn, text) || !get_number(turn, phrase_sent) || !get_number(turn, changed))
+            return false;
+        if (changed && !get_text(turn, name))
+            return false;
+
+        vector<pair<uint32_t, uint32_t>> picks;
+        if (!get_number(turn, count))
+            return false;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t source, index;
+            if (!get_number(turn, source) || !get_number(turn, index))
+                return false;
+            if (source >= reply_sources.size() || index >= reply_sources[source].out->size())
+                return false;
+            picks.push_back({source, index});
+        }
+
+        past_inputs.emplace_back(input_str);
+        refresh();
+        input_str = text;
+        wonderful_phrase_sent = phrase_sent;
+        if (changed)
+            user_name = name;
+
+        // Same steps as prep_sent() and rand_out()
+        for (const pair<uint32_t, uint32_t> &pick : picks)
+        {
+            vector<bool> &sent = *reply_sources[pick.first].sent;
+            sent.resize(max(sent.size(), reply_sources[pick.first].out->size()), false);
+            if (find(sent.begin(), sent.end(), false) == sent.end())
+                replace(sent.begin(), sent.end(), true, false);
+            sent[pick.second] = true;
+        }
+        return true;
+    }
+};
+
+#endif
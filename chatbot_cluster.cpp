@@ -0,0 +1,12 @@
+// chatbot_cluster.cpp
+// Runs Chatbot sessions on a number of worker
+// processes (see chatbot_cluster.h).
+//
+// Usage: chatbot_cluster <workers> [socket directory]
+
+#include "chatbot_cluster.h"
+
+int main(int argc, char **argv)
+{
+    return cluster_main(argc, argv);
+}
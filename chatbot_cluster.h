@@ -0,0 +1,1169 @@
+// chatbot_cluster.h
+// Chatbot sessions spread over worker processes
+
+#ifndef CHATBOT_CLUSTER_H
+#define CHATBOT_CLUSTER_H
+
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "chatbot.h"
+#include "chatbot_journal.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// A cluster is a number of worker processes that each own some of the
+// sessions (one Chatbot per session), and a router that sends each session's
+// turns to its worker over a Unix-domain socket. Sessions are assigned to
+// workers by consistent hashing, so when a worker joins or leaves only the
+// sessions whose owner changes are moved, by copying their saved state
+// (Chatbot::save_state()) from the old worker to the new one; the old worker
+// only forgets a session once the new one has it. A worker given a
+// journal directory writes every change to its sessions there (see
+// chatbot_journal.h) before replying, and gets them back when restarted.
+// The router may be used from any number of threads: turns of different
+// sessions run at the same time, each on its own connection to its worker.
+//
+//      cluster_worker(const string &bot_name, const string &journal_directory)
+//                                      Holds sessions, named bot_name
+//      int cluster_worker::serve(const string &socket_path)
+//                                      Answers requests until told to quit
+//      pid_t cluster_spawn(const string &socket_path, const string &bot_name, const string &journal_directory)
+//                                      Starts a process that runs a worker
+//      void cluster_worker_main(int argc, char **argv)
+//                                      Runs the worker if this process is
+//                                      one cluster_spawn() started
+//      bool cluster_router::add_worker(const string &name, const string &socket_path)
+//                                      Connects to a worker and rebalances
+//      bool cluster_router::balanced()
+//                                      Checks every session is on its owner
+//      bool cluster_router::stats(const string &name, journal_stats_t &stats)
+//                                      Gets what a worker's journal has done
+//      bool cluster_router::remove_worker(const string &name)
+//                                      Moves a worker's sessions away and
+//                                      stops it
+//      bool cluster_router::drop_worker(const string &name)
+//                                      Forgets a worker that can't be
+//                                      reached, and the sessions it held
+//      void cluster_router::quit_all()
+//                                      Stops every worker, leaving their
+//                                      sessions in their journals
+//      bool cluster_router::tell(const string &session, string_view text, string &reply)
+//                                      Sends one turn to the session's worker
+//                                      (thread-safe)
+//      vector<string> cluster_journals(const string &journal_directory)
+//                                      Names the workers with a journal there
+//      bool cluster_number(const char *text, unsigned int &number)
+//                                      Reads a command line number
+//      int cluster_main(int argc, char **argv)
+//                                      Command line front end
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Requests from the router to a worker. Every message either way is a
+// frame: a 4-byte length, then that many bytes. A request starts with one
+// of these bytes and a reply with 0 (done) or 1 (failed); then come the
+// fields, each a 4-byte length and its bytes.
+//  CLUSTER_TELL session text -> reply
+//  CLUSTER_EXPORT session -> state ("" if the worker doesn't have it)
+//  CLUSTER_IMPORT session state -> (nothing)
+//  CLUSTER_QUIT -> (nothing), then the worker exits
+//  CLUSTER_LIST -> each session the worker holds and its number of
+//      past inputs (Chatbot::history_size(), in decimal)
+//  CLUSTER_FORGET session -> (nothing), the worker drops the session
+//  CLUSTER_STATS -> records journaled and syncs (see journal_stats_t),
+//      in decimal
+enum cluster_op : uint8_t
+{
+    CLUSTER_TELL,
+    CLUSTER_EXPORT,
+    CLUSTER_IMPORT,
+    CLUSTER_QUIT,
+    CLUSTER_LIST,
+    CLUSTER_FORGET,
+    CLUSTER_STATS
+};
+
+// Function: cluster_put()
+// Adds a field to a message
+inline void cluster_put(std::string &message, std::string_view field)
+{
+    uint32_t size = field.size();
+    message.append(reinterpret_cast<const char *>(&size), sizeof(size));
+    message.append(field);
+}
+
+// Function: cluster_get()
+// Takes the next field off a message.
+// Returns false if the message is cut short.
+inline bool cluster_get(std::string_view &message, std::string_view &field)
+{
+    uint32_t size;
+    if (message.size() < sizeof(size))
+        return false;
+    memcpy(&size, message.data(), sizeof(size));
+    message.remove_prefix(sizeof(size));
+    if (message.size() < size)
+        return false;
+    field = message.substr(0, size);
+    message.remove_prefix(size);
+    return true;
+}
+
+// Function: cluster_send()
+// Writes one frame to a socket
+inline bool cluster_send(int fd, std::string_view body)
+{
+    uint32_t size = body.size();
+    std::string frame(reinterpret_cast<const char *>(&size), sizeof(size));
+    frame.append(body);
+
+    size_t done = 0;
+    while (done < frame.size())
+    {
+        ssize_t sent = send(fd, frame.data() + done, frame.size() - done, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        done += sent;
+    }
+    return true;
+}
+
+// Function: cluster_read()
+// Reads exactly size bytes from a socket
+inline bool cluster_read(int fd, char *data, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t got = recv(fd, data + done, size - done, 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        done += got;
+    }
+    return true;
+}
+
+// Function: cluster_receive()
+// Reads one frame from a socket
+inline bool cluster_receive(int fd, std::string &body)
+{
+    uint32_t size;
+    if (!cluster_read(fd, reinterpret_cast<char *>(&size), sizeof(size)))
+        return false;
+    body.resize(size);
+    return cluster_read(fd, &body[0], size);
+}
+
+// Function: cluster_address()
+// Fills in a Unix socket address. Returns false
+// if the path is too long for one.
+inline bool cluster_address(const std::string &socket_path, sockaddr_un &address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+        return false;
+    memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+    return true;
+}
+
+// Function: cluster_connect()
+// Connects to a worker's socket, trying again for
+// up to wait_ms while it isn't there yet. Returns
+// the socket, or -1.
+inline int cluster_connect(const std::string &socket_path, int wait_ms)
+{
+    sockaddr_un address;
+    if (!cluster_address(socket_path, address))
+        return -1;
+
+    for (int waited = 0;; waited += 10)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0)
+            return fd;
+        close(fd);
+        if (waited >= wait_ms)
+            return -1;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+class cluster_worker
+{
+private:
+    std::string bot_name;
+    std::unordered_map<std::string, std::unique_ptr<Chatbot>> sessions;
+    bool quit = false;
+    bool broken = false; // A change to a session couldn't be journaled
+
+    // Journal ("" if none)
+    std::string journal_directory;
+    size_t segment_size;
+    journal_writer journal;
+    uint64_t unsynced_lsn = 0; // Last record serve() must wait for before replying
+
+    // Function: record()
+    // Adds a record to the journal, if there is one.
+    // Returns false if it can't be written, and
+    // marks the worker broken (see serve()).
+    bool record(journal_op op, std::string_view id, std::string_view payload)
+    {
+        if (journal_directory.empty())
+            return true;
+        uint64_t lsn = journal.append(op, id, payload);
+        if (lsn == 0)
+        {
+            broken = true;
+            return false;
+        }
+        unsynced_lsn = lsn;
+        return true;
+    }
+
+    // Function: replay()
+    // Rebuilds the sessions from the journal
+    bool replay()
+    {
+        return journal_replay(journal_directory, [this](journal_op op, std::string_view id, std::string_view payload) {
+            if (op == JOURNAL_TURN)
+                session(id).replay_turn(payload);
+            else if (op == JOURNAL_SNAPSHOT)
+                session(id).load_state(payload);
+            else if (op == JOURNAL_DROP)
+                sessions.erase(std::string(id));
+        });
+    }
+
+    // Function: compact()
+    // Replaces the journal with a snapshot of each session
+    void compact()
+    {
+        std::vector<std::pair<std::string, std::string>> states;
+        for (const auto &held : sessions)
+            states.push_back({held.first, held.second->save_state()});
+        journal.compact(states);
+    }
+
+    // Function: session()
+    // Returns the Chatbot for a session, making it if new
+    Chatbot &session(std::string_view id)
+    {
+        std::unique_ptr<Chatbot> &bot = sessions[std::string(id)];
+        if (!bot)
+            bot.reset(new Chatbot(bot_name));
+        return *bot;
+    }
+
+    // Function: handle()
+    // Carries out one request and returns the reply
+    std::string handle(std::string_view request)
+    {
+        std::string reply(1, 1);
+        std::string_view id, text;
+        if (request.empty())
+            return reply;
+
+        uint8_t op = request[0];
+        request.remove_prefix(1);
+        switch (op)
+        {
+        case CLUSTER_TELL:
+            if (!cluster_get(request, id) || !cluster_get(request, text))
+                return reply;
+            {
+                Chatbot &bot = session(id);
+                bot.tell(std::string(text));
+                std::string_view answer = bot.get_reply_view();
+                if (!record(JOURNAL_TURN, id, bot.save_turn()))
+                    return reply;
+                reply[0] = 0;
+                cluster_put(reply, answer);
+            }
+            return reply;
+        case CLUSTER_EXPORT:
+        {
+            if (!cluster_get(request, id))
+                return reply;
+            auto found = sessions.find(std::string(id));
+            cluster_put(reply, found != sessions.end() ? found->second->save_state() : "");
+            reply[0] = 0;
+            return reply;
+        }
+        case CLUSTER_FORGET:
+        {
+            if (!cluster_get(request, id))
+                return reply;
+            auto found = sessions.find(std::string(id));
+            if (found != sessions.end())
+            {
+                if (!record(JOURNAL_DROP, id, ""))
+                    return reply;
+                sessions.erase(found);
+            }
+            reply[0] = 0;
+            return reply;
+        }
+        case CLUSTER_IMPORT:
+            if (!cluster_get(request, id) || !cluster_get(request, text))
+                return reply;
+            if (!text.empty())
+            {
+                // Only hold the session once it loaded and is
+                // journaled, so a failed import leaves nothing
+                std::unique_ptr<Chatbot> bot(new Chatbot(bot_name));
+                if (!bot->load_state(text) || !record(JOURNAL_SNAPSHOT, id, text))
+                    return reply;
+                sessions[std::string(id)] = std::move(bot);
+            }
+            reply[0] = 0;
+            return reply;
+        case CLUSTER_LIST:
+            reply[0] = 0;
+            for (const auto &held : sessions)
+            {
+                cluster_put(reply, held.first);
+                cluster_put(reply, std::to_string(held.second->history_size()));
+            }
+            return reply;
+        case CLUSTER_STATS:
+        {
+            journal_stats_t stats = {};
+            if (!journal_directory.empty())
+                stats = journal.stats();
+            reply[0] = 0;
+            cluster_put(reply, std::to_string(stats.records));
+            cluster_put(reply, std::to_string(stats.syncs));
+            return reply;
+        }
+        case CLUSTER_QUIT:
+            quit = true;
+            reply[0] = 0;
+            return reply;
+        default:
+            return reply;
+        }
+    }
+
+public:
+    cluster_worker(const std::string &name, const std::string &journal_directory = "", size_t segment_size = journal_segment_size)
+    {
+        bot_name = name;
+        this->journal_directory = journal_directory;
+        this->segment_size = segment_size;
+    }
+
+    // Function: serve()
+    // Listens on socket_path and answers requests
+    // from any number of connections, one at a
+    // time, until a CLUSTER_QUIT request. With a
+    // journal, the sessions are replayed first.
+    // Returns 0 then, or 1 if the socket or the
+    // journal can't be used.
+    // A turn changes its session before it can be
+    // journaled, so if a record can't be appended
+    // or synced, the sessions no longer match the
+    // journal. The worker then fails the requests
+    // it has, stops answering and returns 1, so it
+    // is only ever restarted from the journal.
+    int serve(const std::string &socket_path)
+    {
+        sockaddr_un address;
+        if (!cluster_address(socket_path, address))
+            return 1;
+
+        int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0)
+            return 1;
+        unlink(socket_path.c_str());
+        if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listener, 16) != 0)
+        {
+            close(listener);
+            return 1;
+        }
+
+        // The router can connect while this runs;
+        // its requests wait until we're done
+        if (!journal_directory.empty() && (!replay() || !journal.open(journal_directory, segment_size)))
+        {
+            close(listener);
+            unlink(socket_path.c_str());
+            return 1;
+        }
+
+        std::vector<pollfd> fds = {{listener, POLLIN, 0}};
+        std::string request;
+        while (!quit && !broken)
+        {
+            if (poll(fds.data(), fds.size(), -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+
+            if (fds[0].revents & POLLIN)
+            {
+                int client = accept(listener, nullptr, nullptr);
+                if (client >= 0)
+                    fds.push_back({client, POLLIN, 0});
+            }
+
+            // Answer every connection that is ready, then
+            // wait once for all of their records to reach
+            // the journal before sending any reply
+            std::vector<std::pair<int, std::string>> replies;
+            for (size_t i = 1; i < fds.size() && !quit && !broken; i++)
+            {
+                if (fds[i].revents == 0)
+                    continue;
+                if (!cluster_receive(fds[i].fd, request))
+                {
+                    close(fds[i].fd);
+                    fds.erase(fds.begin() + i);
+                    i--;
+                    continue;
+                }
+                replies.push_back({fds[i].fd, handle(request)});
+            }
+
+            if (unsynced_lsn != 0)
+            {
+                if (!journal.wait(unsynced_lsn))
+                    broken = true;
+                unsynced_lsn = 0;
+            }
+            if (broken)
+                for (std::pair<int, std::string> &reply : replies)
+                    reply.second.assign(1, 1);
+            for (std::pair<int, std::string> &reply : replies)
+                if (!cluster_send(reply.first, reply.second))
+                    shutdown(reply.first, SHUT_RDWR); // Closed by the next receive
+
+            if (!broken && !journal_directory.empty() && journal.segments() > journal_compact_after)
+                compact();
+        }
+
+        for (pollfd &fd : fds)
+            close(fd.fd);
+        unlink(socket_path.c_str());
+        if (!journal_directory.empty())
+            journal.close();
+        return broken ? 1 : 0;
+    }
+};
+
+// The first argument of a process started by cluster_spawn()
+const char cluster_worker_flag[] = "--cluster-worker";
+
+// Function: cluster_spawn()
+// Starts a process that runs a worker on
+// socket_path, journaling to journal_directory
+// if it isn't "". Returns its process ID, or
+// -1 if it couldn't be made.
+// The router may have other threads and open
+// connections, so the child only closes every
+// file but standard input, output and error and
+// runs this program again, which must call
+// cluster_worker_main() first thing in main().
+inline pid_t cluster_spawn(const std::string &socket_path, const std::string &bot_name, const std::string &journal_directory = "")
+{
+    std::vector<std::string> args = {"chatbot-worker", cluster_worker_flag, socket_path, bot_name, journal_directory};
+    std::vector<char *> arg_pointers;
+    for (std::string &arg : args)
+        arg_pointers.push_back(&arg[0]);
+    arg_pointers.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close_range(3, ~0U, 0);
+        execv("/proc/self/exe", arg_pointers.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+// Function: cluster_worker_main()
+// If this process was started by cluster_spawn(),
+// runs its worker and exits with what serve()
+// returns. Otherwise returns at once.
+inline void cluster_worker_main(int argc, char **argv)
+{
+    if (argc != 5 || strcmp(argv[1], cluster_worker_flag) != 0)
+        return;
+    cluster_worker worker(argv[3], argv[4]);
+    exit(worker.serve(argv[2]));
+}
+
+// Places workers on a ring of 64-bit hashes. Each worker gets
+// a number of points on the ring, and a session belongs to the
+// worker with the first point at or after the session's hash.
+// Adding or removing a worker only changes the owner of the
+// sessions next to that worker's points.
+class cluster_ring
+{
+private:
+    std::map<uint64_t, std::string> points;
+    unsigned int points_per_worker;
+
+public:
+    cluster_ring(unsigned int points_per_worker = 128)
+    {
+        this->points_per_worker = points_per_worker;
+    }
+
+    // Function: hash()
+    // FNV-1a, then mixed so that similar
+    // names spread over the whole ring
+    static uint64_t hash(std::string_view text)
+    {
+        uint64_t result = 14695981039346656037ull;
+        for (char ch : text)
+        {
+            result ^= (unsigned char)ch;
+            result *= 1099511628211ull;
+        }
+        result ^= result >> 33;
+        result *= 0xff51afd7ed558ccdull;
+        result ^= result >> 33;
+        return result;
+    }
+
+    void add(const std::string &worker)
+    {
+        for (unsigned int i = 0; i < points_per_worker; i++)
+            points[hash(worker + "#" + std::to_string(i))] = worker;
+    }
+
+    void remove(const std::string &worker)
+    {
+        for (auto it = points.begin(); it != points.end();)
+        {
+            if (it->second == worker)
+                it = points.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    bool empty() const
+    {
+        return points.empty();
+    }
+
+    // Function: owner()
+    // Returns the worker that owns a session
+    // ("" if there are no workers)
+    std::string owner(std::string_view session) const
+    {
+        if (points.empty())
+            return "";
+        auto it = points.lower_bound(hash(session));
+        if (it == points.end())
+            it = points.begin();
+        return it->second;
+    }
+};
+
+class cluster_router
+{
+private:
+    // A worker's connections. Each carries one request and its
+    // reply at a time: call() takes an idle one (or opens another)
+    // and gives it back after, so calls from different threads
+    // are in flight at once, and the worker answers all of them
+    // in one poll round (sharing one journal sync).
+    typedef struct cluster_link_t
+    {
+        std::string socket_path;
+        std::mutex mutex;
+        std::vector<int> idle;
+    } cluster_link_t;
+
+    // ring and workers only change with members_mutex held
+    // exclusively (adding or removing a worker and moving
+    // sessions). tell() holds it shared, so turns run alongside
+    // each other but never during a move; it changes held under
+    // held_mutex.
+    std::shared_mutex members_mutex;
+    std::mutex held_mutex;
+    cluster_ring ring;
+    std::map<std::string, std::unique_ptr<cluster_link_t>> workers; // Worker name -> connections
+
+    // Where a session's state is: the worker holding it, and
+    // its number of past inputs as the worker listed it when
+    // added (cluster_live once this router sent it a turn or
+    // moved it), to tell which copy is newer if two workers
+    // list it. Turns go to this worker even if the ring names
+    // another, until a move succeeds.
+    typedef struct cluster_held_t
+    {
+        std::string worker;
+        size_t history;
+    } cluster_held_t;
+    static const size_t cluster_live = SIZE_MAX;
+    std::unordered_map<std::string, cluster_held_t> held; // Session -> where it is
+
+    // Function: call()
+    // Sends a request to a worker and waits for the
+    // reply. On success, fields holds the reply's fields.
+    // Called with members_mutex held (shared or not).
+    bool call(const std::string &worker, const std::string &request, std::string &reply, std::string_view &fields)
+    {
+        auto found = workers.find(worker);
+        if (found == workers.end())
+            return false;
+
+        cluster_link_t &link = *found->second;
+        int fd = -1;
+        {
+            std::lock_guard<std::mutex> lock(link.mutex);
+            if (!link.idle.empty())
+            {
+                fd = link.idle.back();
+                link.idle.pop_back();
+            }
+        }
+        if (fd < 0 && (fd = cluster_connect(link.socket_path, 0)) < 0)
+            return false;
+
+        if (!cluster_send(fd, request) || !cluster_receive(fd, reply))
+        {
+            close(fd);
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(link.mutex);
+            link.idle.push_back(fd);
+        }
+
+        if (reply.empty() || reply[0] != 0)
+            return false;
+        fields = std::string_view(reply).substr(1);
+        return true;
+    }
+
+    // Function: worker_list()
+    // Returns the names of the workers.
+    // Called with members_mutex held.
+    std::vector<std::string> worker_list() const
+    {
+        std::vector<std::string> result;
+        for (const auto &worker : workers)
+            result.push_back(worker.first);
+        return result;
+    }
+
+    // Function: close_link()
+    // Closes every connection to a worker and
+    // forgets it. Called with members_mutex held.
+    void close_link(const std::string &name)
+    {
+        for (int fd : workers[name]->idle)
+            close(fd);
+        workers.erase(name);
+    }
+
+    // Function: forget()
+    // Tells a worker to drop its copy of a session
+    bool forget(const std::string &worker, const std::string &session)
+    {
+        std::string request(1, CLUSTER_FORGET);
+        std::string reply;
+        std::string_view fields;
+        cluster_put(request, session);
+        return call(worker, request, reply, fields);
+    }
+
+    // Function: move_session()
+    // Copies a session's state from one worker to
+    // another, and only once the new worker has it
+    // (and has journaled it) tells the old one to
+    // forget it. If the copy fails, the session stays
+    // on the old worker. If forgetting fails, the old
+    // copy is left behind, and add_worker() drops it
+    // if it ever finds both.
+    bool move_session(const std::string &session, const std::string &from, const std::string &to)
+    {
+        std::string request(1, CLUSTER_EXPORT);
+        std::string reply;
+        std::string_view fields, state;
+        cluster_put(request, session);
+        if (!call(from, request, reply, fields) || !cluster_get(fields, state))
+            return false;
+
+        std::string import(1, CLUSTER_IMPORT);
+        cluster_put(import, session);
+        cluster_put(import, state);
+        std::string import_reply;
+        if (!call(to, import, import_reply, fields))
+            return false;
+
+        forget(from, session);
+        held[session] = {to, cluster_live}; // from may name this entry
+        return true;
+    }
+
+    // Function: rebalance()
+    // Moves every session whose owner on the ring is
+    // not the worker holding it. Returns false if any
+    // move failed (those sessions stay where they were).
+    bool rebalance()
+    {
+        bool result = true;
+        std::vector<std::pair<std::string, std::string>> moves;
+        for (const auto &session : held)
+        {
+            std::string owner = ring.owner(session.first);
+            if (owner != session.second.worker)
+                moves.push_back({session.first, owner});
+        }
+        for (const auto &move : moves)
+            if (!move_session(move.first, held[move.first].worker, move.second))
+                result = false;
+        return result;
+    }
+
+public:
+    ~cluster_router()
+    {
+        for (const auto &worker : workers)
+            for (int fd : worker.second->idle)
+                close(fd);
+    }
+
+    // Function: add_worker()
+    // Connects to a worker (waiting up to two seconds
+    // for its socket to appear), puts it on the ring
+    // and moves the sessions it now owns to it, as
+    // well as any it already held but doesn't own.
+    // Returns false, and leaves the worker out, if it
+    // can't be reached or can't list its sessions.
+    // Sessions that can't be moved stay where they
+    // are (see balanced()).
+    bool add_worker(const std::string &name, const std::string &socket_path)
+    {
+        std::unique_lock<std::shared_mutex> lock(members_mutex);
+        if (workers.count(name) != 0)
+            return false;
+
+        int fd = cluster_connect(socket_path, 2000);
+        if (fd < 0)
+            return false;
+
+        std::unique_ptr<cluster_link_t> &link = workers[name];
+        link.reset(new cluster_link_t);
+        link->socket_path = socket_path;
+        link->idle.push_back(fd);
+        ring.add(name);
+
+        // A worker restarted from its journal already
+        // holds sessions; move any it no longer owns.
+        // If another worker has one too (a move was cut
+        // short before the old copy was forgotten), keep
+        // the copy with more past inputs.
+        std::string reply;
+        std::string_view fields, session, count;
+        if (!call(name, std::string(1, CLUSTER_LIST), reply, fields))
+        {
+            ring.remove(name);
+            close_link(name);
+            return false;
+        }
+        while (cluster_get(fields, session) && cluster_get(fields, count))
+        {
+            size_t history = strtoull(std::string(count).c_str(), nullptr, 10);
+            auto found = held.find(std::string(session));
+            if (found == held.end())
+            {
+                held[std::string(session)] = {name, history};
+                continue;
+            }
+            std::string stale = name;
+            if (history > found->second.history)
+            {
+                stale = found->second.worker;
+                found->second = {name, history};
+            }
+            forget(stale, std::string(session));
+        }
+        rebalance();
+        return true;
+    }
+
+    // Function: remove_worker()
+    // Takes a worker off the ring, moves its sessions
+    // to their new owners and tells it to quit. If
+    // any of its sessions can't be moved (or it is the
+    // last worker), it is put back on the ring and
+    // keeps running, and false is returned.
+    bool remove_worker(const std::string &name)
+    {
+        std::unique_lock<std::shared_mutex> lock(members_mutex);
+        if (workers.count(name) == 0)
+            return false;
+
+        ring.remove(name);
+        if (ring.empty() || !rebalance())
+        {
+            ring.add(name);
+            return false;
+        }
+
+        std::string reply;
+        std::string_view fields;
+        call(name, std::string(1, CLUSTER_QUIT), reply, fields);
+        close_link(name);
+        return true;
+    }
+
+    // Function: drop_worker()
+    // Takes a worker that can't be reached (e.g. one
+    // that crashed) off the ring without asking it
+    // anything, and forgets the sessions it held.
+    // Their next turns go to their new owners, which
+    // start them afresh unless they are brought back
+    // from the worker's journal (see cluster_main()).
+    bool drop_worker(const std::string &name)
+    {
+        std::unique_lock<std::shared_mutex> lock(members_mutex);
+        if (workers.count(name) == 0)
+            return false;
+
+        ring.remove(name);
+        close_link(name);
+        std::lock_guard<std::mutex> held_lock(held_mutex);
+        for (auto it = held.begin(); it != held.end();)
+        {
+            if (it->second.worker == name)
+                it = held.erase(it);
+            else
+                ++it;
+        }
+        return true;
+    }
+
+    // Function: quit_all()
+    // Tells every worker to quit without moving
+    // any sessions. Workers with a journal get
+    // their sessions back when started again.
+    void quit_all()
+    {
+        std::unique_lock<std::shared_mutex> lock(members_mutex);
+        std::string reply;
+        std::string_view fields;
+        for (const std::string &name : worker_list())
+        {
+            call(name, std::string(1, CLUSTER_QUIT), reply, fields);
+            close_link(name);
+            ring.remove(name);
+        }
+        held.clear();
+    }
+
+    // Function: stats()
+    // Gets how many records a worker has journaled
+    // and how many syncs that took (all 0 for a
+    // worker without a journal)
+    bool stats(const std::string &name, journal_stats_t &stats)
+    {
+        std::shared_lock<std::shared_mutex> lock(members_mutex);
+        std::string reply;
+        std::string_view fields, records, syncs;
+        if (!call(name, std::string(1, CLUSTER_STATS), reply, fields) || !cluster_get(fields, records) || !cluster_get(fields, syncs))
+            return false;
+        stats.records = strtoull(std::string(records).c_str(), nullptr, 10);
+        stats.syncs = strtoull(std::string(syncs).c_str(), nullptr, 10);
+        return true;
+    }
+
+    // Function: balanced()
+    // Checks that every session is on the
+    // worker that owns it on the ring
+    bool balanced()
+    {
+        std::shared_lock<std::shared_mutex> lock(members_mutex);
+        std::lock_guard<std::mutex> held_lock(held_mutex);
+        for (const auto &session : held)
+            if (ring.owner(session.first) != session.second.worker)
+                return false;
+        return true;
+    }
+
+    // Function: tell()
+    // Sends one turn of a session to the worker
+    // that owns it and gets the reply
+    bool tell(const std::string &session, std::string_view text, std::string &reply)
+    {
+        std::shared_lock<std::shared_mutex> lock(members_mutex);
+        std::string owner;
+        {
+            std::lock_guard<std::mutex> held_lock(held_mutex);
+            auto found = held.find(session);
+            owner = found != held.end() ? found->second.worker : ring.owner(session);
+        }
+        if (owner == "")
+            return false;
+
+        std::string request(1, CLUSTER_TELL);
+        cluster_put(request, session);
+        cluster_put(request, text);
+
+        std::string response;
+        std::string_view fields, field;
+        if (!call(owner, request, response, fields) || !cluster_get(fields, field))
+            return false;
+
+        std::lock_guard<std::mutex> held_lock(held_mutex);
+        held[session] = {owner, cluster_live};
+        reply = field;
+        return true;
+    }
+
+    // Function: sessions_on()
+    // Returns the number of sessions a worker holds
+    size_t sessions_on(const std::string &name)
+    {
+        std::shared_lock<std::shared_mutex> lock(members_mutex);
+        std::lock_guard<std::mutex> held_lock(held_mutex);
+        size_t result = 0;
+        for (const auto &session : held)
+            if (session.second.worker == name)
+                result++;
+        return result;
+    }
+
+    std::vector<std::string> worker_names()
+    {
+        std::shared_lock<std::shared_mutex> lock(members_mutex);
+        return worker_list();
+    }
+};
+
+// Function: cluster_journals()
+// Returns the names of the subdirectories of
+// journal_directory that hold journal segments,
+// one for each worker that journaled there
+inline std::vector<std::string> cluster_journals(const std::string &journal_directory)
+{
+    std::vector<std::string> result;
+    DIR *dir = opendir(journal_directory.c_str());
+    if (dir == nullptr)
+        return result;
+
+    while (dirent *entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        if (name != "." && name != ".." && !journal_segments(journal_directory + "/" + name).empty())
+            result.push_back(name);
+    }
+    closedir(dir);
+
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+// Function: cluster_number()
+// Reads text as a decimal number into number.
+// Returns false if text is not all digits or
+// the number doesn't fit.
+inline bool cluster_number(const char *text, unsigned int &number)
+{
+    const char *end = text + strlen(text);
+    std::from_chars_result result = std::from_chars(text, end, number);
+    return end != text && result.ec == std::errc() && result.ptr == end;
+}
+
+// Function: cluster_main()
+// Usage: <program> <workers> [socket directory] [journal directory]
+// Reads "<session> <text>" lines from standard
+// input and prints each reply. The lines ":add"
+// and ":remove <worker>" start and stop workers,
+// and ":workers" lists the sessions each holds.
+// At the end of input the workers quit without
+// moving their sessions.
+// With a journal directory, each worker keeps its
+// journal in a subdirectory named after it, so
+// running again with the same directory brings
+// the sessions back. A journal of a worker that
+// isn't started this time (e.g. one added with
+// ":add" last time) is replayed by a worker that
+// moves its sessions to their owners, stops, and
+// deletes it.
+// A worker that can't be reached (e.g. it crashed)
+// can't move its sessions, so ":remove" kills it
+// and drops it, then replays its journal the same
+// way. Without a journal its sessions are lost.
+inline int cluster_main(int argc, char **argv)
+{
+    cluster_worker_main(argc, argv);
+
+    unsigned int count;
+    if (argc < 2 || argc > 4 || !cluster_number(argv[1], count))
+    {
+        std::cerr << "Usage: " << argv[0] << " <workers> [socket directory] [journal directory]\n";
+        return 2;
+    }
+
+    std::string directory = argc > 2 ? argv[2] : "/tmp";
+    std::string prefix = directory + "/chatbot-" + std::to_string(getpid()) + "-";
+    std::string journal_directory = argc > 3 ? argv[3] : "";
+    if (journal_directory != "" && mkdir(journal_directory.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        std::cerr << "Cannot make " << journal_directory << "\n";
+        return 1;
+    }
+
+    cluster_router router;
+    std::map<std::string, pid_t> pids;
+    unsigned int next_worker = 0;
+
+    auto start = [&](const std::string &name) {
+        std::string socket_path = prefix + name + ".sock";
+        pid_t pid = cluster_spawn(socket_path, "Chatbot", journal_directory == "" ? "" : journal_directory + "/" + name);
+        if (pid < 0)
+            return false;
+        if (!router.add_worker(name, socket_path))
+        {
+            std::cerr << "Cannot add " << name << "\n";
+            kill(pid, SIGTERM);
+            waitpid(pid, nullptr, 0);
+            return false;
+        }
+        pids[name] = pid;
+        std::cout << "added " << name << "\n";
+        if (!router.balanced())
+            std::cerr << "Cannot move every session to its owner\n";
+        return true;
+    };
+
+    auto stop = [&](const std::string &name) {
+        if (!router.remove_worker(name))
+        {
+            std::cerr << "Cannot move every session off " << name << "\n";
+            return false;
+        }
+        waitpid(pids[name], nullptr, 0);
+        pids.erase(name);
+        return true;
+    };
+
+    // Moves the sessions in a journal to their owners
+    // by running a worker on it, then deletes it
+    auto replay = [&](const std::string &name) {
+        if (!start(name) || !stop(name))
+            return false;
+        journal_remove(journal_directory + "/" + name);
+        return true;
+    };
+
+    // Stops a worker, or if it can't be reached, kills
+    // it, drops it and brings its sessions back from
+    // its journal
+    auto remove = [&](const std::string &name) {
+        journal_stats_t stats;
+        if (router.stats(name, stats))
+            return stop(name);
+
+        std::cerr << "Cannot reach " << name << ", dropping it\n";
+        kill(pids[name], SIGKILL);
+        waitpid(pids[name], nullptr, 0);
+        pids.erase(name);
+        router.drop_worker(name);
+        return journal_directory == "" || replay(name);
+    };
+
+    auto stop_all = [&]() {
+        router.quit_all();
+        for (const std::pair<const std::string, pid_t> &pid : pids)
+            waitpid(pid.second, nullptr, 0);
+    };
+
+    for (; next_worker < count; next_worker++)
+    {
+        if (!start("worker" + std::to_string(next_worker)))
+        {
+            stop_all();
+            return 1;
+        }
+    }
+
+    // Bring back the sessions of journals no
+    // started worker has
+    for (const std::string &name : cluster_journals(journal_directory))
+        if (pids.count(name) == 0 && replay(name))
+            std::cout << "removed " << name << "\n";
+
+    std::string line;
+    while (std::getline(std::cin, line))
+    {
+        if (line == ":add")
+        {
+            std::string name;
+            do
+                name = "worker" + std::to_string(next_worker++);
+            while (pids.count(name) != 0);
+            start(name);
+        }
+        else if (line.compare(0, 8, ":remove ") == 0)
+        {
+            std::string name = line.substr(8);
+            if (pids.count(name) == 0)
+                std::cerr << "No worker " << name << "\n";
+            else if (remove(name))
+                std::cout << "removed " << name << "\n";
+        }
+        else if (line == ":workers")
+        {
+            for (const std::string &name : router.worker_names())
+                std::cout << name << ' ' << router.sessions_on(name) << "\n";
+        }
+        else
+        {
+            size_t space = line.find(' ');
+            std::string session = line.substr(0, space);
+            std::string text = space == std::string::npos ? "" : line.substr(space + 1);
+            std::string reply;
+            if (router.tell(session, text, reply))
+                std::cout << session << ": " << reply << "\n";
+            else
+                std::cerr << "No reply for " << session << "\n";
+        }
+    }
+
+    stop_all();
+    return 0;
+}
+
+#endif
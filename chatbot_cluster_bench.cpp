@@ -0,0 +1,92 @@
+// chatbot_cluster_bench.cpp
+// Sends turns through one cluster_router from several
+// threads to journaled workers (see chatbot_cluster.h),
+// then prints the turns per second and, for each worker,
+// the records its journal wrote and the syncs that took.
+// With more than one thread, turns that reach a worker
+// in the same poll round share a sync, so a worker
+// shows more records than syncs.
+//
+// Usage: chatbot_cluster_bench <journal directory> [workers] [threads] [turns]
+
+#include <atomic>
+#include "chatbot_cluster.h"
+
+int main(int argc, char **argv)
+{
+    cluster_worker_main(argc, argv);
+
+    // Every number must be given in full, and
+    // there must be at least one worker and thread
+    unsigned int workers = 2;
+    unsigned int threads = 16;
+    unsigned int turns = 8000;
+    if (argc < 2 || argc > 5 || (argc > 2 && !cluster_number(argv[2], workers)) || (argc > 3 && !cluster_number(argv[3], threads)) ||
+        (argc > 4 && !cluster_number(argv[4], turns)) || workers == 0 || threads == 0)
+    {
+        std::cerr << "Usage: " << argv[0] << " <journal directory> [workers] [threads] [turns]\n";
+        return 2;
+    }
+
+    std::string journal_directory = argv[1];
+    if (mkdir(journal_directory.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        std::cerr << "Cannot make " << journal_directory << "\n";
+        return 1;
+    }
+
+    cluster_router router;
+    std::vector<pid_t> pids;
+    std::string prefix = "/tmp/chatbot-bench-" + std::to_string(getpid()) + "-";
+    for (unsigned int i = 0; i < workers; i++)
+    {
+        std::string name = "worker" + std::to_string(i);
+        pid_t pid = cluster_spawn(prefix + name + ".sock", "Chatbot", journal_directory + "/" + name);
+        if (pid < 0)
+            return 1;
+        pids.push_back(pid);
+        if (!router.add_worker(name, prefix + name + ".sock"))
+        {
+            std::cerr << "Cannot add " << name << "\n";
+            router.quit_all();
+            for (pid_t started : pids)
+            {
+                kill(started, SIGTERM);
+                waitpid(started, nullptr, 0);
+            }
+            return 1;
+        }
+    }
+
+    // Each thread talks to four sessions of its own
+    const std::vector<std::string> lines = {"hi", "my name is Sam", "do you like snacks?", "i love them!", "we are going to the park", "i was walking my dog", "today is wednesday!", "why not?", "hakuna matata", "you are so mean"};
+    std::atomic<unsigned int> failed{0};
+    std::vector<std::thread> talkers;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned int t = 0; t < threads; t++)
+    {
+        talkers.emplace_back([&, t] {
+            std::string reply;
+            for (unsigned int i = t; i < turns; i += threads)
+                if (!router.tell("t" + std::to_string(t) + "-" + std::to_string(i % 4), lines[i % lines.size()], reply))
+                    failed++;
+        });
+    }
+    for (std::thread &talker : talkers)
+        talker.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << threads << " threads, " << turns << " turns, " << int(turns / seconds) << " turns/s, " << failed << " failed\n";
+    for (const std::string &name : router.worker_names())
+    {
+        journal_stats_t stats;
+        if (router.stats(name, stats))
+            std::cout << name << ": " << stats.records << " records, " << stats.syncs << " syncs, "
+                      << (stats.syncs == 0 ? 0.0 : double(stats.records) / stats.syncs) << " records per sync\n";
+    }
+
+    router.quit_all();
+    for (pid_t pid : pids)
+        waitpid(pid, nullptr, 0);
+    return failed == 0 ? 0 : 1;
+}
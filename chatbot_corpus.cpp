@@ -0,0 +1,12 @@
+// chatbot_corpus.cpp
+// Counts which stage and key of Chatbot would answer
+// each line of a chat log (see chatbot_corpus.h).
+//
+// Usage: chatbot_corpus <log file> [threads] [top]
+
+#include "chatbot_corpus.h"
+
+int main(int argc, char **argv)
+{
+    return corpus_main(argc, argv);
+}
@@ -0,0 +1,257 @@
+// chatbot_corpus.h
+// Offline analysis of chat logs with Chatbot::classify()
+
+#ifndef CHATBOT_CORPUS_H
+#define CHATBOT_CORPUS_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "chatbot.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Runs the analysis part of get_reply() over a newline-delimited log of user
+// messages. The log is memory-mapped and split into one chunk per thread;
+// each thread classifies its lines with its own Chatbot and keeps its own
+// counts, which are merged at the end. The functions are:
+//
+//      bool corpus_analyze(const char *path, unsigned int threads, corpus_stats_t &stats)
+//                                      Counts which stage and key answer each line
+//      void corpus_print(const corpus_stats_t &stats, ostream &out, size_t top)
+//                                      Prints the counts
+//      bool corpus_number(const char *text, T &number)
+//                                      Reads a command line number
+//      int corpus_main(int argc, char **argv)
+//                                      Command line front end
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Counts for a corpus
+//  lines: number of lines classified
+//  stages[s]: lines answered by stage s
+//  keys: lines answered by each (stage, branch, keychain, key),
+//      packed by corpus_key()
+//  stage_ns[s]: total nanoseconds spent in stage s
+typedef struct corpus_stats_t
+{
+    uint64_t lines = 0;
+    std::array<uint64_t, TRACE_STAGES> stages = {};
+    std::unordered_map<uint64_t, uint64_t> keys;
+    std::array<uint64_t, TRACE_STAGES> stage_ns = {};
+} corpus_stats_t;
+
+// Function: corpus_key()
+// Packs the match of a trace record into one number
+inline uint64_t corpus_key(const trace_record_t &record)
+{
+    return (uint64_t(record.stage) << 48) | (uint64_t(record.branch) << 32) | (uint64_t(uint16_t(record.keychain)) << 16) | uint16_t(record.key);
+}
+
+// Function: corpus_record()
+// Unpacks corpus_key() into a trace record
+inline trace_record_t corpus_record(uint64_t key)
+{
+    trace_record_t record = {};
+    record.stage = uint8_t(key >> 48);
+    record.branch = uint8_t(key >> 32);
+    record.keychain = int16_t(uint16_t(key >> 16));
+    record.key = int16_t(uint16_t(key));
+    return record;
+}
+
+// Function: corpus_add()
+// Adds the counts of part to stats
+inline void corpus_add(corpus_stats_t &stats, const corpus_stats_t &part)
+{
+    stats.lines += part.lines;
+    for (int stage = 0; stage < TRACE_STAGES; stage++)
+    {
+        stats.stages[stage] += part.stages[stage];
+        stats.stage_ns[stage] += part.stage_ns[stage];
+    }
+    for (const std::pair<const uint64_t, uint64_t> &key : part.keys)
+        stats.keys[key.first] += key.second;
+}
+
+// Function: corpus_chunk()
+// Classifies every line in [begin, end)
+inline void corpus_chunk(const char *begin, const char *end, corpus_stats_t &stats)
+{
+    Chatbot bot("corpus");
+    const char *line = begin;
+    while (line < end)
+    {
+        const char *newline = static_cast<const char *>(memchr(line, '\n', end - line));
+        if (newline == nullptr)
+            newline = end;
+
+        std::string_view text(line, newline - line);
+        if (!text.empty() && text.back() == '\r')
+            text.remove_suffix(1);
+
+        const trace_record_t &record = bot.classify(text);
+        stats.lines++;
+        stats.stages[record.stage]++;
+        stats.keys[corpus_key(record)]++;
+        for (int stage = 0; stage < TRACE_STAGES; stage++)
+            stats.stage_ns[stage] += record.stage_ns[stage];
+
+        line = newline + 1;
+    }
+}
+
+// Function: corpus_analyze()
+// Maps the log at path and classifies it with
+// the given number of threads (0 means one per
+// core). Chunks end at line breaks, so no line
+// is split between threads. Returns false if
+// the file can't be read.
+inline bool corpus_analyze(const char *path, unsigned int threads, corpus_stats_t &stats)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = info.st_size;
+    if (size == 0)
+    {
+        close(fd);
+        return true;
+    }
+
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        return false;
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    const char *data = static_cast<const char *>(mapped);
+    const char *end = data + size;
+
+    // Cut the log into chunks of about equal size,
+    // moving each cut to just after a line break
+    std::vector<const char *> cuts = {data};
+    for (unsigned int i = 1; i < threads; i++)
+    {
+        const char *cut = std::max(cuts.back(), data + size / threads * i);
+        const char *newline = static_cast<const char *>(memchr(cut, '\n', end - cut));
+        cut = newline == nullptr ? end : newline + 1;
+        cuts.push_back(cut);
+    }
+    cuts.push_back(end);
+
+    std::vector<corpus_stats_t> parts(threads);
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < threads; i++)
+        if (cuts[i] < cuts[i + 1])
+            workers.emplace_back(corpus_chunk, cuts[i], cuts[i + 1], std::ref(parts[i]));
+    for (std::thread &worker : workers)
+        worker.join();
+
+    for (const corpus_stats_t &part : parts)
+        corpus_add(stats, part);
+
+    munmap(mapped, size);
+    return true;
+}
+
+// Function: corpus_print()
+// Prints how often each stage answered, then
+// the top most common matches with their keys.
+inline void corpus_print(const corpus_stats_t &stats, std::ostream &out, size_t top)
+{
+    double lines = stats.lines == 0 ? 1 : stats.lines;
+
+    out << "lines " << stats.lines << "\n\n";
+    out << "stage      lines      share    avg ns\n";
+    for (int stage = 0; stage < TRACE_STAGES; stage++)
+    {
+        out << std::left << std::setw(10) << trace_stage_names[stage] << std::right
+            << std::setw(12) << stats.stages[stage]
+            << std::setw(10) << std::fixed << std::setprecision(2) << 100.0 * stats.stages[stage] / lines << "%"
+            << std::setw(10) << uint64_t(stats.stage_ns[stage] / lines) << "\n";
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> keys(stats.keys.begin(), stats.keys.end());
+    std::sort(keys.begin(), keys.end(), [](const std::pair<uint64_t, uint64_t> &a, const std::pair<uint64_t, uint64_t> &b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+    if (keys.size() > top)
+        keys.resize(top);
+
+    Chatbot bot("corpus");
+    out << "\nstage      branch keychain  key        lines      share  text\n";
+    for (const std::pair<uint64_t, uint64_t> &key : keys)
+    {
+        trace_record_t record = corpus_record(key.first);
+        out << std::left << std::setw(10) << trace_stage_names[record.stage] << std::right
+            << std::setw(7) << int(record.branch)
+            << std::setw(9) << record.keychain
+            << std::setw(5) << record.key
+            << std::setw(13) << key.second
+            << std::setw(10) << std::fixed << std::setprecision(2) << 100.0 * key.second / lines << "%"
+            << "  " << bot.key_text(record) << "\n";
+    }
+}
+
+// Function: corpus_number()
+// Reads text as a decimal number into number.
+// Returns false if text is not all digits or
+// the number doesn't fit.
+template <typename T>
+bool corpus_number(const char *text, T &number)
+{
+    const char *end = text + strlen(text);
+    std::from_chars_result result = std::from_chars(text, end, number);
+    return end != text && result.ec == std::errc() && result.ptr == end;
+}
+
+// Function: corpus_main()
+// Usage: <program> <log file> [threads] [top]
+inline int corpus_main(int argc, char **argv)
+{
+    unsigned int threads = 0;
+    size_t top = 50;
+    if (argc < 2 || argc > 4 || (argc > 2 && !corpus_number(argv[2], threads)) || (argc > 3 && !corpus_number(argv[3], top)))
+    {
+        std::cerr << "Usage: " << argv[0] << " <log file> [threads] [top]\n";
+        return 2;
+    }
+
+    corpus_stats_t stats;
+    if (!corpus_analyze(argv[1], threads, stats))
+    {
+        std::cerr << "Cannot read " << argv[1] << "\n";
+        return 1;
+    }
+    corpus_print(stats, std::cout, top);
+    return 0;
+}
+
+#endif
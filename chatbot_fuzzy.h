@@ -0,0 +1,305 @@
+// chatbot_fuzzy.h
+// Keyword matching that allows typos
+
+#ifndef CHATBOT_FUZZY_H
+#define CHATBOT_FUZZY_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Finds keys that were typed with a few mistakes (letters added, left out or
+// changed), e.g. "wensday" for "wednesday". A key found with typos starts at
+// the start of a word and ends at the end of one (or anywhere, for verb
+// stems), and its first and last characters must be typed right, so "thing"
+// is not taken for "think". Keys that start inside a word (e.g. "re a robot",
+// for "you're a robot") are therefore only found exactly. The functions
+// return the number of mistakes, so callers can take the closest key. The
+// edit distance is computed with Myers' bit-parallel algorithm: one 64-bit
+// word holds a whole column of the distance table, so each input character
+// costs a few bit operations however long the key is. Before that, a key is
+// only tried if enough of its bigrams are in the input (each mistake can
+// remove at most two of them). The keys are indexed by bigram, so counting
+// those for every key only looks at the keys that share a bigram with the
+// input. The functions are:
+//
+//      unsigned int fuzzy_errors(size_t size)
+//                                      Mistakes allowed in a key of that size
+//      void fuzzy_build(const vector<string_view> &keys, fuzzy_index_t &index)
+//                                      Indexes keys by their bigrams
+//      void fuzzy_sign(string_view text, fuzzy_pairs_t &pairs)
+//                                      Lists the bigrams of text
+//      void fuzzy_count(const fuzzy_index_t &index, const fuzzy_pairs_t &pairs, vector<uint8_t> &hits)
+//                                      Counts each key's bigrams in the text
+//      bool fuzzy_may_match(const fuzzy_index_t &index, const vector<uint8_t> &hits, size_t key)
+//                                      Bigram filter
+//      unsigned int fuzzy_distance(const fuzzy_pattern_t &pattern, string_view text, unsigned int errors, fuzzy_end end)
+//                                      Edit distance from a key to the start of text
+//      unsigned int fuzzy_search(string_view key, string_view text)
+//                                      Mistakes in the closest match of key
+//                                      to whole words of text
+//      unsigned int fuzzy_compare(string_view key, string_view word)
+//                                      Mistakes in word if it is key
+//
+// Exact matches come before any match with typos, so callers look for
+// them first (with find() or ==), which is cheaper.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Every bigram of a text, as one bit per pair of fuzzy_code()s
+typedef struct fuzzy_pairs_t
+{
+    uint64_t bits[16];
+} fuzzy_pairs_t;
+
+// Keys indexed by their bigrams
+//  errors[k]: mistakes allowed in key k (see fuzzy_errors())
+//  needed[k]: bigrams a text must share with key k to
+//      be within errors[k] mistakes of it
+//  first[p] to first[p + 1]: where the keys with bigram p
+//      are listed in keys (once for each time they have it)
+typedef struct fuzzy_index_t
+{
+    std::vector<uint8_t> errors;
+    std::vector<uint8_t> needed;
+    std::vector<uint32_t> first;
+    std::vector<uint16_t> keys;
+} fuzzy_index_t;
+
+// Where a match found by fuzzy_distance() may end
+//  FUZZY_ANYWHERE: anywhere in text (a verb stem, like "walk" in "walked")
+//  FUZZY_WORD_END: at the end of a word of text
+//  FUZZY_WHOLE: at the end of text
+enum fuzzy_end
+{
+    FUZZY_ANYWHERE,
+    FUZZY_WORD_END,
+    FUZZY_WHOLE
+};
+
+// The most mistakes fuzzy_errors() allows
+const unsigned int fuzzy_max_errors = 2;
+
+// A key ready for fuzzy_distance()
+//  match[c]: bit i is set if character i of the key has code c
+//  last: bit of the key's last character
+//  size: length of the key
+typedef struct fuzzy_pattern_t
+{
+    std::array<uint64_t, 32> match;
+    uint64_t last;
+    unsigned int size;
+} fuzzy_pattern_t;
+
+// Function: fuzzy_code()
+// Maps the characters keys are made of to 1 to 31
+// (letters, space, apostrophe, '?', '.' and '!').
+// Anything else is 0.
+inline unsigned int fuzzy_code(char ch)
+{
+    static const std::array<uint8_t, 256> codes = [] {
+        std::array<uint8_t, 256> made = {};
+        for (char letter = 'a'; letter <= 'z'; letter++)
+            made[(unsigned char)letter] = letter - 'a' + 1;
+        made[' '] = 27;
+        made['\''] = 28;
+        made['?'] = 29;
+        made['.'] = 30;
+        made['!'] = 31;
+        return made;
+    }();
+    return codes[(unsigned char)ch];
+}
+
+// Function: fuzzy_letter()
+// Checks if ch can be part of a word (a letter
+// or an apostrophe, as in "what's")
+inline bool fuzzy_letter(char ch)
+{
+    unsigned int code = fuzzy_code(ch);
+    return (code >= 1 && code <= 26) || code == 28;
+}
+
+// Function: fuzzy_pair()
+// Returns the bit number of a bigram
+inline unsigned int fuzzy_pair(char first, char second)
+{
+    return (fuzzy_code(first) << 5) | fuzzy_code(second);
+}
+
+// Function: fuzzy_errors()
+// Returns how many mistakes a key may have. Short
+// keys must match exactly, or "hate" would be
+// found in "have" and "no" in nearly anything.
+inline unsigned int fuzzy_errors(size_t size)
+{
+    if (size < 5 || size > 64)
+        return 0;
+    if (size < 9)
+        return 1;
+    return fuzzy_max_errors;
+}
+
+// Function: fuzzy_sign()
+// Lists the bigrams of text in pairs
+inline void fuzzy_sign(std::string_view text, fuzzy_pairs_t &pairs)
+{
+    pairs = {};
+    for (size_t i = 1; i < text.size(); i++)
+    {
+        unsigned int pair = fuzzy_pair(text[i - 1], text[i]);
+        pairs.bits[pair >> 6] |= uint64_t(1) << (pair & 63);
+    }
+}
+
+// Function: fuzzy_build()
+// Indexes keys (at most 65536) by their bigrams.
+// Keys that must match exactly aren't listed.
+inline void fuzzy_build(const std::vector<std::string_view> &keys, fuzzy_index_t &index)
+{
+    index = {};
+    index.first.assign(1024 + 1, 0);
+    for (std::string_view key : keys)
+    {
+        unsigned int errors = fuzzy_errors(key.size());
+        index.errors.push_back(errors);
+        index.needed.push_back(errors == 0 ? 0 : key.size() - 1 - 2 * errors);
+        for (size_t i = 1; errors != 0 && i < key.size(); i++)
+            index.first[fuzzy_pair(key[i - 1], key[i]) + 1]++;
+    }
+    for (size_t pair = 0; pair < 1024; pair++)
+        index.first[pair + 1] += index.first[pair];
+
+    index.keys.resize(index.first[1024]);
+    std::vector<uint32_t> next(index.first.begin(), index.first.end() - 1);
+    for (size_t k = 0; k < keys.size(); k++)
+        for (size_t i = 1; index.errors[k] != 0 && i < keys[k].size(); i++)
+            index.keys[next[fuzzy_pair(keys[k][i - 1], keys[k][i])]++] = k;
+}
+
+// Function: fuzzy_count()
+// Sets hits[k] to the number of key k's bigrams
+// that are in pairs (counting repeats in the key),
+// going through only the keys listed for those pairs.
+inline void fuzzy_count(const fuzzy_index_t &index, const fuzzy_pairs_t &pairs, std::vector<uint8_t> &hits)
+{
+    hits.assign(index.errors.size(), 0);
+    for (unsigned int word = 0; word < 16; word++)
+    {
+        for (uint64_t bits = pairs.bits[word]; bits != 0; bits &= bits - 1)
+        {
+            unsigned int pair = word * 64 + __builtin_ctzll(bits);
+            for (uint32_t i = index.first[pair]; i < index.first[pair + 1]; i++)
+                hits[index.keys[i]]++;
+        }
+    }
+}
+
+// Function: fuzzy_may_match()
+// A text within errors mistakes of a key has all
+// but at most 2 * errors of the key's bigrams
+// (q-gram lemma). Returns false if the text
+// counted in hits has fewer, so key can't be
+// in it with typos.
+inline bool fuzzy_may_match(const fuzzy_index_t &index, const std::vector<uint8_t> &hits, size_t key)
+{
+    return index.errors[key] != 0 && hits[key] >= index.needed[key];
+}
+
+// Function: fuzzy_pattern()
+// Makes the match masks for a key of up to 64 characters
+inline fuzzy_pattern_t fuzzy_pattern(std::string_view key)
+{
+    fuzzy_pattern_t pattern = {};
+    for (size_t i = 0; i < key.size(); i++)
+        pattern.match[fuzzy_code(key[i])] |= uint64_t(1) << i;
+    pattern.last = uint64_t(1) << (key.size() - 1);
+    pattern.size = key.size();
+    return pattern;
+}
+
+// Function: fuzzy_distance()
+// Returns the edit distance between the key and
+// the start of text, up to where end says the
+// match may end (the closest such end is taken).
+// The match must start and end with the key's
+// first and last characters. Only distances up
+// to errors are exact; anything larger is
+// returned as more than errors.
+// Myers' algorithm keeps, for each key character,
+// whether the distance goes up (pv) or down (mv)
+// from the character above; shifting a 1 into ph
+// makes each column start one higher than the last,
+// so the match has to start at text[0].
+inline unsigned int fuzzy_distance(const fuzzy_pattern_t &pattern, std::string_view text, unsigned int errors, fuzzy_end end)
+{
+    if (end == FUZZY_WHOLE && (text.size() > pattern.size + errors || text.size() + errors < pattern.size))
+        return errors + 1;
+    if (text.empty() || (pattern.match[fuzzy_code(text[0])] & 1) == 0)
+        return errors + 1;
+
+    uint64_t pv = ~uint64_t(0);
+    uint64_t mv = 0;
+    unsigned int score = pattern.size;
+    unsigned int best = errors + 1;
+    size_t stop = std::min(text.size(), size_t(pattern.size + errors));
+    for (size_t i = 0; i < stop; i++)
+    {
+        uint64_t eq = pattern.match[fuzzy_code(text[i])];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        if (ph & pattern.last)
+            score++;
+        else if (mh & pattern.last)
+            score--;
+        ph = (ph << 1) | 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+
+        // The match may end after text[i] if that is the
+        // key's last character and end allows it there
+        bool at_end = i + 1 == text.size();
+        if ((eq & pattern.last) && (end == FUZZY_ANYWHERE || at_end || (end == FUZZY_WORD_END && !fuzzy_letter(text[i + 1]))))
+            best = std::min(best, score);
+    }
+    return best;
+}
+
+// Function: fuzzy_search()
+// Returns the fewest mistakes (up to
+// fuzzy_errors()) that key is typed with
+// in text, as whole words of it, or
+// fuzzy_max_errors + 1 if it isn't there
+inline unsigned int fuzzy_search(std::string_view key, std::string_view text)
+{
+    unsigned int errors = fuzzy_errors(key.size());
+    unsigned int best = errors + 1;
+    if (errors != 0)
+    {
+        fuzzy_pattern_t pattern = fuzzy_pattern(key);
+        for (size_t start = 0; start < text.size() && best > 0; start++)
+            if ((start == 0 || !fuzzy_letter(text[start - 1])) && text[start] == key[0])
+                best = std::min(best, fuzzy_distance(pattern, text.substr(start), errors, FUZZY_WORD_END));
+    }
+    return best <= errors ? best : fuzzy_max_errors + 1;
+}
+
+// Function: fuzzy_compare()
+// Returns the mistakes (up to fuzzy_errors())
+// that word has if it is key typed wrong, or
+// fuzzy_max_errors + 1 if it isn't
+inline unsigned int fuzzy_compare(std::string_view key, std::string_view word)
+{
+    unsigned int errors = fuzzy_errors(key.size());
+    unsigned int distance = errors == 0 ? 1 : fuzzy_distance(fuzzy_pattern(key), word, errors, FUZZY_WHOLE);
+    return distance <= errors ? distance : fuzzy_max_errors + 1;
+}
+
+#endif
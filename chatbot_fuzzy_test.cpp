@@ -0,0 +1,82 @@
+// chatbot_fuzzy_test.cpp
+// Checks which key Chatbot::classify() finds for inputs
+// with typos (see chatbot_fuzzy.h): the key is found as
+// whole words only, with its first and last characters
+// typed right, and the key with the fewest typos wins
+// over the first one in rank order.
+// Prints one line per check and exits with 1 if any fail.
+//
+// Usage: chatbot_fuzzy_test
+
+#include "chatbot.h"
+
+static int failures = 0;
+
+// Function: check()
+// Prints the result of one check
+static void check(bool passed, const std::string &name)
+{
+    std::cout << (passed ? "ok   " : "FAIL ") << name << "\n";
+    if (!passed)
+        failures++;
+}
+
+// Function: found()
+// Returns the key bot finds in line ("" if none),
+// and whether it only matched with typos
+static std::string found(Chatbot &bot, const std::string &line, bool &fuzzy)
+{
+    const trace_record_t &record = bot.classify(line);
+    fuzzy = (record.flags & TRACE_FUZZY) != 0;
+    return bot.key_text(record);
+}
+
+// Function: check_key()
+// Checks that bot finds key in line, with typos
+// if fuzzy is true and exactly if not
+static void check_key(Chatbot &bot, const std::string &line, const std::string &key, bool fuzzy)
+{
+    bool was_fuzzy;
+    std::string key_found = found(bot, line, was_fuzzy);
+    check(key_found == key && was_fuzzy == fuzzy, "\"" + line + "\" finds \"" + key + "\"" + (fuzzy ? " with typos" : "") + (key_found == key ? "" : " (found \"" + key_found + "\")"));
+}
+
+int main()
+{
+    Chatbot bot("Chatbot");
+    bot.set_fuzzy(true);
+
+    // Typos in a keychain key and a single-word key
+    check_key(bot, "helo", "hello", true);
+    check_key(bot, "wensday", "wednesday", true);
+    check_key(bot, "yipee", "yippee", true);
+
+    // An exact match is still found first
+    check_key(bot, "hello", "hello", false);
+
+    // "think" is earlier in rank order, but only the
+    // start of "thnks" is close to it; the whole word
+    // is one typo from "thanks" and two from "think"
+    check_key(bot, "thnks", "thanks", true);
+    check_key(bot, "thnks a lot", "thanks", true);
+
+    // "farewell" has one typo here and "disgruntled"
+    // (earlier in rank order) two
+    check_key(bot, "disgruntd farewel", "farewell", true);
+
+    // The last character must be typed right
+    {
+        bool fuzzy;
+        std::string key_found = found(bot, "thing", fuzzy);
+        check(key_found != "think" && !fuzzy, "\"thing\" doesn't find \"think\"");
+    }
+
+    // With typos not allowed, only exact keys are found
+    {
+        Chatbot exact("Chatbot");
+        bool fuzzy;
+        std::string key_found = found(exact, "helo", fuzzy);
+        check(key_found != "hello" && !fuzzy, "\"helo\" doesn't find \"hello\" with typos off");
+    }
+    return failures == 0 ? 0 : 1;
+}
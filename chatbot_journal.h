@@ -0,0 +1,582 @@
+// chatbot_journal.h
+// Write-ahead journal of Chatbot sessions
+
+#ifndef CHATBOT_JOURNAL_H
+#define CHATBOT_JOURNAL_H
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// A journal is a directory of append-only segment files. Each record names a
+// session and holds either one turn (Chatbot::save_turn()), a whole session
+// (Chatbot::save_state()) or a note that the session left. Segments are
+// memory-mapped, so appending a record is a copy; a flusher thread then syncs
+// everything appended since its last sync at once, so sessions that commit at
+// the same time share one sync instead of paying for one each. When a segment
+// is full the next one is started, and compact() replaces all segments with
+// one snapshot per session. On startup, journal_replay() reads the records
+// back in order to rebuild the sessions.
+//
+//      bool journal_replay(const string &directory, function apply)
+//                                      Calls apply for every record
+//      bool journal_remove(const string &directory)
+//                                      Deletes a journal
+//      bool journal_writer::open(const string &directory, size_t segment_size)
+//                                      Starts a new segment after any there
+//      uint64_t journal_writer::append(journal_op op, string_view session, string_view payload)
+//                                      Adds a record; returns its LSN
+//      bool journal_writer::wait(uint64_t lsn)
+//                                      Waits until the record is on disk
+//      bool journal_writer::commit(journal_op op, string_view session, string_view payload)
+//                                      append() and then wait()
+//      bool journal_writer::compact(const vector<pair<string, string>> &states)
+//                                      Replaces the journal with snapshots
+//      journal_stats_t journal_writer::stats()
+//                                      Counts records and syncs
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// What a record holds
+//  JOURNAL_TURN: a turn from Chatbot::save_turn()
+//  JOURNAL_SNAPSHOT: a session from Chatbot::save_state()
+//  JOURNAL_DROP: the session was removed (nothing)
+enum journal_op : uint8_t
+{
+    JOURNAL_TURN,
+    JOURNAL_SNAPSHOT,
+    JOURNAL_DROP
+};
+
+// A segment starts with a header: the magic, the version and its
+// sequence number (8 bytes). Then come records, each its body size
+// (4 bytes), a CRC-32 of the body (4 bytes) and the body: the op,
+// the session's length (4 bytes) and name, and the payload. The
+// rest of the segment is zeros, which end it.
+const char journal_magic[4] = {'C', 'B', 'J', 'N'};
+const uint32_t journal_version = 1;
+const size_t journal_header_size = 16;
+const size_t journal_record_header_size = 8;
+const size_t journal_segment_size = 64 << 20;
+const size_t journal_compact_after = 4; // Segments
+
+// What a journal_writer has done since open()
+//  records: records appended
+//  syncs: syncs that made records durable (fewer than
+//      records when commits share a sync)
+typedef struct journal_stats_t
+{
+    uint64_t records;
+    uint64_t syncs;
+} journal_stats_t;
+
+// Function: journal_crc()
+// CRC-32 (the one zlib uses)
+inline uint32_t journal_crc(const char *data, size_t size)
+{
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> made;
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = crc & 1 ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+            made[i] = crc;
+        }
+        return made;
+    }();
+
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffff;
+}
+
+// Function: journal_path()
+// Returns the file name of a segment. Sequence numbers
+// are written in fixed-width hex, so names sort in order.
+inline std::string journal_path(const std::string &directory, uint64_t sequence)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "journal-%016llx.seg", (unsigned long long)sequence);
+    return directory + "/" + name;
+}
+
+// Function: journal_segments()
+// Returns the sequence numbers of the
+// segments in directory, oldest first
+inline std::vector<uint64_t> journal_segments(const std::string &directory)
+{
+    std::vector<uint64_t> result;
+    DIR *dir = opendir(directory.c_str());
+    if (dir == nullptr)
+        return result;
+
+    while (dirent *entry = readdir(dir))
+    {
+        unsigned long long sequence;
+        char end;
+        if (strlen(entry->d_name) == 28 && sscanf(entry->d_name, "journal-%16llx.se%c", &sequence, &end) == 2 && end == 'g')
+            result.push_back(sequence);
+    }
+    closedir(dir);
+
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+// Function: journal_sync_directory()
+// Makes file creation and removal in directory durable
+inline void journal_sync_directory(const std::string &directory)
+{
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// Function: journal_replay()
+// Calls apply(op, session, payload) for every record
+// in directory, oldest first. A segment ends at the
+// first record that is zero, cut short or fails its
+// checksum, since that is where a crash stopped
+// writing. Returns false if a segment can't be read.
+inline bool journal_replay(const std::string &directory, const std::function<void(journal_op, std::string_view, std::string_view)> &apply)
+{
+    for (uint64_t sequence : journal_segments(directory))
+    {
+        int fd = ::open(journal_path(directory, sequence).c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+        {
+            close(fd);
+            return false;
+        }
+        size_t size = info.st_size;
+        if (size < journal_header_size) // Crashed while making it
+        {
+            close(fd);
+            continue;
+        }
+
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED)
+            return false;
+        madvise(mapped, size, MADV_SEQUENTIAL);
+
+        const char *data = static_cast<const char *>(mapped);
+        uint32_t version;
+        memcpy(&version, data + 4, sizeof(version));
+        if (memcmp(data, journal_magic, sizeof(journal_magic)) != 0 || version != journal_version)
+        {
+            bool blank = std::all_of(data, data + journal_header_size, [](char ch) { return ch == 0; });
+            munmap(mapped, size);
+            if (blank) // Crashed before its header was written
+                continue;
+            return false;
+        }
+
+        size_t offset = journal_header_size;
+        while (offset + journal_record_header_size <= size)
+        {
+            uint32_t body_size, crc, session_size;
+            memcpy(&body_size, data + offset, sizeof(body_size));
+            memcpy(&crc, data + offset + 4, sizeof(crc));
+            const char *body = data + offset + journal_record_header_size;
+            if (body_size < 5 || body_size > size - offset - journal_record_header_size || journal_crc(body, body_size) != crc)
+                break;
+
+            memcpy(&session_size, body + 1, sizeof(session_size));
+            if (session_size > body_size - 5)
+                break;
+            std::string_view session(body + 5, session_size);
+            std::string_view payload(body + 5 + session_size, body_size - 5 - session_size);
+            apply(journal_op(body[0]), session, payload);
+
+            offset += journal_record_header_size + body_size;
+        }
+        munmap(mapped, size);
+    }
+    return true;
+}
+
+// Function: journal_remove()
+// Deletes a journal's segments, oldest first, and
+// then its directory. Only for a journal whose
+// sessions are all kept somewhere else: a crash
+// part way through leaves the newest segments,
+// whose drops still remove those sessions.
+inline bool journal_remove(const std::string &directory)
+{
+    for (uint64_t sequence : journal_segments(directory))
+        if (unlink(journal_path(directory, sequence).c_str()) != 0)
+            return false;
+    return rmdir(directory.c_str()) == 0;
+}
+
+class journal_writer
+{
+private:
+    std::string directory;
+    size_t segment_size = journal_segment_size;
+    std::vector<uint64_t> sequences; // Segments on disk, oldest first; the last is being written
+
+    // The segment being written
+    int fd = -1;
+    char *map = nullptr;
+    size_t map_size = 0;
+    size_t used = 0;       // Bytes of the segment written so far
+    uint64_t base_lsn = 0; // LSN of the segment's first record
+
+    // An LSN counts the record bytes appended since open(). A record
+    // is on disk once durable_lsn reaches the LSN append() gave it.
+    uint64_t written_lsn = 0;
+    uint64_t durable_lsn = 0;
+    bool syncing = false; // The flusher is syncing without holding mutex
+    bool failed = false;  // A write or sync failed; nothing more is appended
+    bool stopping = false;
+    journal_stats_t counts = {};
+
+    std::mutex mutex;
+    std::condition_variable work;   // Wakes the flusher
+    std::condition_variable synced; // Wakes wait() and rotation
+    std::thread flusher;
+
+    // Function: start_segment()
+    // Makes, sizes and maps a new segment big enough
+    // for at least min_size bytes of records.
+    // Called with mutex held.
+    bool start_segment(uint64_t sequence, size_t min_size)
+    {
+        std::string path = journal_path(directory, sequence);
+        size_t size = std::max(segment_size, journal_header_size + min_size);
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0)
+            return false;
+
+        void *mapped = MAP_FAILED;
+        if (posix_fallocate(fd, 0, size) == 0)
+            mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED)
+        {
+            ::close(fd);
+            unlink(path.c_str());
+            fd = -1;
+            return false;
+        }
+
+        map = static_cast<char *>(mapped);
+        map_size = size;
+        memcpy(map, journal_magic, sizeof(journal_magic));
+        memcpy(map + 4, &journal_version, sizeof(journal_version));
+        memcpy(map + 8, &sequence, sizeof(sequence));
+        used = journal_header_size;
+        base_lsn = written_lsn;
+
+        msync(map, journal_header_size, MS_SYNC);
+        journal_sync_directory(directory);
+        sequences.push_back(sequence);
+        return true;
+    }
+
+    // Function: end_segment()
+    // Syncs what is left of the current segment,
+    // trims it to the records it holds and unmaps
+    // it. Called with mutex held while the
+    // flusher is not syncing.
+    void end_segment()
+    {
+        if (fd < 0)
+            return;
+
+        if (written_lsn > durable_lsn)
+        {
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t from = (journal_header_size + durable_lsn - base_lsn) / page * page;
+            if (msync(map + from, used - from, MS_SYNC) == 0)
+            {
+                durable_lsn = written_lsn;
+                counts.syncs++;
+            }
+            else
+                failed = true;
+            synced.notify_all();
+        }
+
+        munmap(map, map_size);
+        if (!failed && ftruncate(fd, used) == 0)
+            fdatasync(fd);
+        ::close(fd);
+        fd = -1;
+        map = nullptr;
+    }
+
+    // Function: write_record()
+    // Copies a record into the current segment,
+    // starting the next segment if it doesn't fit.
+    // Called with mutex held. Returns the record's
+    // LSN, or 0 if it couldn't be written.
+    uint64_t write_record(std::unique_lock<std::mutex> &lock, const std::string &record)
+    {
+        if (failed || fd < 0)
+            return 0;
+
+        if (used + record.size() > map_size)
+        {
+            synced.wait(lock, [this] { return !syncing; });
+            end_segment();
+            if (failed || !start_segment(sequences.back() + 1, record.size()))
+            {
+                failed = true;
+                synced.notify_all();
+                return 0;
+            }
+        }
+
+        memcpy(map + used, record.data(), record.size());
+        used += record.size();
+        written_lsn += record.size();
+        counts.records++;
+        return written_lsn;
+    }
+
+    // Function: make_record()
+    // Lays out a record (see journal_magic)
+    static std::string make_record(journal_op op, std::string_view session, std::string_view payload)
+    {
+        uint32_t body_size = 5 + session.size() + payload.size();
+        uint32_t session_size = session.size();
+        std::string record(journal_record_header_size, '\0');
+        record.reserve(journal_record_header_size + body_size);
+        record.push_back(op);
+        record.append(reinterpret_cast<const char *>(&session_size), sizeof(session_size));
+        record.append(session);
+        record.append(payload);
+
+        uint32_t crc = journal_crc(record.data() + journal_record_header_size, body_size);
+        memcpy(&record[0], &body_size, sizeof(body_size));
+        memcpy(&record[4], &crc, sizeof(crc));
+        return record;
+    }
+
+    // Function: flush()
+    // The flusher thread. Each pass syncs every record
+    // appended since the last pass, so all commits
+    // waiting on them are done by one sync (group
+    // commit). Records keep being appended while a
+    // sync runs and go into the next pass.
+    void flush()
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!failed)
+        {
+            work.wait(lock, [this] { return stopping || written_lsn > durable_lsn; });
+            if (written_lsn == durable_lsn)
+                break; // Stopping, and nothing is left to sync
+
+            uint64_t target = written_lsn;
+            size_t from = (journal_header_size + durable_lsn - base_lsn) / page * page;
+            size_t to = journal_header_size + target - base_lsn;
+            char *data = map;
+            syncing = true;
+
+            lock.unlock();
+            bool done = msync(data + from, to - from, MS_SYNC) == 0;
+            lock.lock();
+
+            syncing = false;
+            if (done)
+            {
+                durable_lsn = std::max(durable_lsn, target);
+                counts.syncs++;
+            }
+            else
+                failed = true;
+            synced.notify_all();
+        }
+    }
+
+public:
+    ~journal_writer()
+    {
+        close();
+    }
+
+    // Function: open()
+    // Starts writing to directory (made if needed).
+    // Records go into a new segment after any that
+    // are there, so a segment cut short by a crash
+    // is never written to again. Replay the
+    // directory with journal_replay() first.
+    bool open(const std::string &directory, size_t segment_size = journal_segment_size)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (fd >= 0 || (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST))
+            return false;
+
+        this->directory = directory;
+        this->segment_size = segment_size;
+        sequences = journal_segments(directory);
+        uint64_t sequence = sequences.empty() ? 1 : sequences.back() + 1;
+        written_lsn = durable_lsn = 0;
+        failed = stopping = false;
+        counts = {};
+        if (!start_segment(sequence, 0))
+            return false;
+
+        flusher = std::thread(&journal_writer::flush, this);
+        return true;
+    }
+
+    // Function: close()
+    // Syncs everything appended and stops writing
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work.notify_one();
+        if (flusher.joinable())
+            flusher.join();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        end_segment();
+    }
+
+    // Function: append()
+    // Adds a record without waiting for it to reach
+    // the disk. Returns the LSN to pass to wait(),
+    // or 0 if the journal can't be written.
+    uint64_t append(journal_op op, std::string_view session, std::string_view payload)
+    {
+        std::string record = make_record(op, session, payload);
+        std::unique_lock<std::mutex> lock(mutex);
+        uint64_t lsn = write_record(lock, record);
+        if (lsn != 0)
+            work.notify_one();
+        return lsn;
+    }
+
+    // Function: wait()
+    // Waits until every record up to lsn is on disk.
+    // Returns false if that won't happen (lsn is 0
+    // or a sync failed).
+    bool wait(uint64_t lsn)
+    {
+        if (lsn == 0)
+            return false;
+        std::unique_lock<std::mutex> lock(mutex);
+        synced.wait(lock, [&] { return durable_lsn >= lsn || failed; });
+        return durable_lsn >= lsn;
+    }
+
+    // Function: commit()
+    // Adds a record and waits until it is on disk
+    bool commit(journal_op op, std::string_view session, std::string_view payload)
+    {
+        return wait(append(op, session, payload));
+    }
+
+    // Function: segments()
+    // Returns the number of segments on disk
+    size_t segments()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return sequences.size();
+    }
+
+    // Function: stats()
+    // Returns how many records were appended
+    // and how many syncs made them durable
+    journal_stats_t stats()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counts;
+    }
+
+    // Function: compact()
+    // Writes a snapshot of each session (name and
+    // save_state()) to a new segment, syncs it and
+    // deletes every older segment. Sessions must not
+    // be changed between taking their snapshots and
+    // the end of compact(), or those turns are lost.
+    // A crash part way through leaves a journal that
+    // replays to the same sessions.
+    bool compact(const std::vector<std::pair<std::string, std::string>> &states)
+    {
+        std::vector<std::string> records;
+        size_t size = 0;
+        for (const std::pair<std::string, std::string> &state : states)
+        {
+            records.push_back(make_record(JOURNAL_SNAPSHOT, state.first, state.second));
+            size += records.back().size();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (failed || fd < 0)
+            return false;
+        synced.wait(lock, [this] { return !syncing; });
+        end_segment();
+        if (failed || !start_segment(sequences.back() + 1, size))
+        {
+            failed = true;
+            synced.notify_all();
+            return false;
+        }
+
+        // All snapshots fit in the new segment, so
+        // every segment before it can go once it is
+        // on disk
+        for (const std::string &record : records)
+            write_record(lock, record);
+        if (written_lsn > durable_lsn)
+        {
+            if (msync(map, used, MS_SYNC) != 0)
+            {
+                failed = true;
+                synced.notify_all();
+                return false;
+            }
+            durable_lsn = written_lsn;
+            counts.syncs++;
+            synced.notify_all();
+        }
+
+        uint64_t first = sequences.back();
+        for (uint64_t sequence : sequences)
+            if (sequence < first)
+                unlink(journal_path(directory, sequence).c_str());
+        sequences.assign(1, first);
+        journal_sync_directory(directory);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,284 @@
+// chatbot_journal_test.cpp
+// Checks that a journal (see chatbot_journal.h) gives back
+// the sessions that wrote it: after turns, across segment
+// rotation, after a crash (a process that exits without
+// closing its journal), with a torn or corrupt last record,
+// and after a crash during or after compaction.
+// Prints one line per check and exits with 1 if any fail.
+//
+// Usage: chatbot_journal_test
+
+#include <sys/wait.h>
+#include <map>
+#include <memory>
+#include "chatbot.h"
+#include "chatbot_journal.h"
+
+typedef std::map<std::string, std::string> states_t; // Session -> save_state()
+
+static int failures = 0;
+
+// Function: check()
+// Prints the result of one check
+static void check(bool passed, const std::string &name)
+{
+    std::cout << (passed ? "ok   " : "FAIL ") << name << "\n";
+    if (!passed)
+        failures++;
+}
+
+// Inputs that exercise the state a turn changes: the user
+// name, the place in "Hakuna Matata", repeats, and outputs
+// picked from most kinds of keychain
+static const std::vector<std::string> lines = {"hi", "my name is Sam", "hakuna matata", "what a wonderful phrase", "do you like snacks?", "i love them!", "i love them!", "i love them!", "we are going to the park", "i was walking my dog", "today is wednesday!", "why not?", "", "you are so mean", "i am sad", "my name is Kim", "what is my name?", "ha", "because i said so", "walk the walk"};
+
+// Function: talk()
+// Runs turns of a session and journals each one.
+// Returns false if a record can't be committed.
+static bool talk(journal_writer &journal, const std::string &id, Chatbot &bot, size_t first, size_t count)
+{
+    for (size_t i = first; i < first + count; i++)
+    {
+        bot.tell(lines[i % lines.size()]);
+        bot.get_reply_view();
+        if (!journal.commit(JOURNAL_TURN, id, bot.save_turn()))
+            return false;
+    }
+    return true;
+}
+
+// Function: replay()
+// Rebuilds the sessions in a journal, the way
+// cluster_worker does, and returns their states
+static states_t replay(const std::string &directory, bool &read)
+{
+    std::map<std::string, std::unique_ptr<Chatbot>> sessions;
+    read = journal_replay(directory, [&](journal_op op, std::string_view id, std::string_view payload) {
+        std::unique_ptr<Chatbot> &bot = sessions[std::string(id)];
+        if (!bot)
+            bot.reset(new Chatbot("Chatbot"));
+        if (op == JOURNAL_TURN)
+            bot->replay_turn(payload);
+        else if (op == JOURNAL_SNAPSHOT)
+            bot->load_state(payload);
+        else if (op == JOURNAL_DROP)
+            sessions.erase(std::string(id));
+    });
+
+    states_t result;
+    for (const auto &session : sessions)
+        result[session.first] = session.second->save_state();
+    return result;
+}
+
+// Function: replays_to()
+// Checks that a journal replays to states
+static bool replays_to(const std::string &directory, const states_t &states)
+{
+    bool read;
+    return replay(directory, read) == states && read;
+}
+
+// Function: crashed()
+// Runs work in a child process that exits without
+// closing its journal, as if it crashed once its
+// commits returned. Returns the states the child
+// had then (sent back through a pipe).
+static states_t crashed(const std::function<bool(states_t &)> &work)
+{
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0)
+        return {};
+
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(pipe_fds[0]);
+        states_t states;
+        if (work(states))
+        {
+            for (const auto &state : states)
+            {
+                std::string message;
+                for (const std::string *field : {&state.first, &state.second})
+                {
+                    uint32_t size = field->size();
+                    message.append(reinterpret_cast<const char *>(&size), sizeof(size));
+                    message.append(*field);
+                }
+                if (write(pipe_fds[1], message.data(), message.size()) != ssize_t(message.size()))
+                    _exit(1);
+            }
+        }
+        _exit(0);
+    }
+    close(pipe_fds[1]);
+
+    std::string received;
+    char buffer[4096];
+    ssize_t got;
+    while ((got = read(pipe_fds[0], buffer, sizeof(buffer))) > 0)
+        received.append(buffer, got);
+    close(pipe_fds[0]);
+    waitpid(pid, nullptr, 0);
+
+    states_t states;
+    std::string_view rest = received;
+    while (!rest.empty())
+    {
+        std::string fields[2];
+        for (std::string &field : fields)
+        {
+            uint32_t size;
+            memcpy(&size, rest.data(), sizeof(size));
+            field = rest.substr(sizeof(size), size);
+            rest.remove_prefix(sizeof(size) + size);
+        }
+        states[fields[0]] = fields[1];
+    }
+    return states;
+}
+
+// Function: last_segment()
+// Returns the path of a journal's newest segment
+static std::string last_segment(const std::string &directory)
+{
+    return journal_path(directory, journal_segments(directory).back());
+}
+
+int main()
+{
+    char made[] = "/tmp/chatbot-journal-test-XXXXXX";
+    if (mkdtemp(made) == nullptr)
+    {
+        std::cerr << "Cannot make a directory in /tmp\n";
+        return 1;
+    }
+    std::string root = made;
+
+    // Replaying each turn gives the same session as the live
+    // one, after every turn and from a save_state() on
+    {
+        Chatbot live("Chatbot"), replayed("Chatbot"), restored("Chatbot");
+        bool same = true;
+        for (size_t i = 0; i < 3 * lines.size(); i++)
+        {
+            live.tell(lines[i % lines.size()]);
+            live.get_reply_view();
+            std::string turn = live.save_turn();
+            same = same && replayed.replay_turn(turn) && replayed.save_state() == live.save_state();
+            if (i == lines.size())
+                same = same && restored.load_state(live.save_state());
+            else if (i > lines.size())
+                same = same && restored.replay_turn(turn) && restored.save_state() == live.save_state();
+        }
+        check(same, "replay_turn() matches live turns");
+    }
+
+    // Small segments rotate, and replay reads them in order
+    {
+        std::string directory = root + "/rotate";
+        journal_writer journal;
+        std::map<std::string, std::unique_ptr<Chatbot>> bots;
+        states_t states;
+        bool committed = journal.open(directory, 4096);
+        for (int round = 0; round < 10; round++)
+        {
+            for (const std::string id : {"a", "b", "c"})
+            {
+                std::unique_ptr<Chatbot> &bot = bots[id];
+                if (!bot)
+                    bot.reset(new Chatbot("Chatbot"));
+                committed = committed && talk(journal, id, *bot, round * 7, 7);
+            }
+        }
+        for (const auto &bot : bots)
+            states[bot.first] = bot.second->save_state();
+        size_t segments = journal.segments();
+        journal.close();
+        check(committed && segments > 1, "segments rotate (" + std::to_string(segments) + " segments)");
+        check(replays_to(directory, states), "replay across segments");
+    }
+
+    // A crash after commit() returned loses nothing, even
+    // though the segment was never trimmed or closed
+    std::string crash_directory = root + "/crash";
+    states_t crash_states = crashed([&](states_t &states) {
+        journal_writer *journal = new journal_writer; // Never closed
+        Chatbot bot("Chatbot");
+        if (!journal->open(crash_directory) || !talk(*journal, "a", bot, 0, 25))
+            return false;
+        states["a"] = bot.save_state();
+        return true;
+    });
+    check(!crash_states.empty() && replays_to(crash_directory, crash_states), "replay after a crash");
+
+    // A torn or corrupt last record is left out, and
+    // everything before it is kept
+    {
+        std::string directory = root + "/torn";
+        journal_writer journal;
+        Chatbot bot("Chatbot");
+        states_t before;
+        bool committed = journal.open(directory) && talk(journal, "a", bot, 0, 10);
+        before["a"] = bot.save_state();
+        committed = committed && talk(journal, "a", bot, 10, 1);
+        journal.close();
+
+        std::string path = last_segment(directory);
+        struct stat info;
+        stat(path.c_str(), &info);
+        off_t size = info.st_size;
+
+        // Flip a byte of the last record's payload
+        int fd = open(path.c_str(), O_RDWR);
+        char byte;
+        pread(fd, &byte, 1, size - 1);
+        byte ^= 0x55;
+        pwrite(fd, &byte, 1, size - 1);
+        check(committed && replays_to(directory, before), "corrupt last record is skipped");
+
+        // Cut the last record short
+        ftruncate(fd, size - 3);
+        check(replays_to(directory, before), "torn last record is skipped");
+        close(fd);
+    }
+
+    // A crash after compaction (snapshots, then more turns)
+    // replays to the live sessions
+    std::string compact_directory = root + "/compact";
+    std::string saved_directory = root + "/saved";
+    states_t compact_states = crashed([&](states_t &states) {
+        journal_writer *journal = new journal_writer; // Never closed
+        Chatbot a("Chatbot"), b("Chatbot");
+        if (!journal->open(compact_directory, 4096) || !talk(*journal, "a", a, 0, 20) || !talk(*journal, "b", b, 5, 20))
+            return false;
+
+        // Keep the segments compaction deletes, to put
+        // back below as if it crashed before deleting them
+        mkdir(saved_directory.c_str(), 0755);
+        for (uint64_t sequence : journal_segments(compact_directory))
+            link(journal_path(compact_directory, sequence).c_str(), journal_path(saved_directory, sequence).c_str());
+
+        if (!journal->compact({{"a", a.save_state()}, {"b", b.save_state()}}) || !talk(*journal, "a", a, 20, 5))
+            return false;
+        states["a"] = a.save_state();
+        states["b"] = b.save_state();
+        return true;
+    });
+    size_t compacted = journal_segments(compact_directory).size();
+    check(!compact_states.empty() && compacted == 1 && replays_to(compact_directory, compact_states), "replay after a crash after compaction");
+
+    // If compaction crashed after writing its snapshots but
+    // before deleting the older segments, replay is the same
+    for (uint64_t sequence : journal_segments(saved_directory))
+        rename(journal_path(saved_directory, sequence).c_str(), journal_path(compact_directory, sequence).c_str());
+    size_t restored = journal_segments(compact_directory).size();
+    check(restored > compacted && replays_to(compact_directory, compact_states), "replay after a crash during compaction");
+
+    for (const std::string name : {"rotate", "crash", "torn", "compact", "saved"})
+        journal_remove(root + "/" + name);
+    rmdir(root.c_str());
+    return failures == 0 ? 0 : 1;
+}
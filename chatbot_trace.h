@@ -0,0 +1,309 @@
+// chatbot_trace.h
+// Per-turn tracing for Chatbot
+
+#ifndef CHATBOT_TRACE_H
+#define CHATBOT_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Every call to Chatbot::get_reply() writes one fixed-size trace_record_t into
+// a ring buffer owned by the calling thread. Writing a record is a copy and a
+// few atomic stores, so tracing is always on. The functions are:
+//
+//      void trace_add_ns(uint32_t &field, uint64_t ns)
+//                                      Adds ns to a stage_ns field
+//      void trace_write(const trace_record_t &record)
+//                                      Adds record to this thread's ring
+//      vector<trace_record_t> trace_collect()
+//                                      Copies the records from every ring
+//      void trace_dump(ostream &out)   Writes all records to out in binary
+//      bool trace_decode(istream &in, ostream &out)
+//                                      Turns a binary dump into text
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// The stages of get_reply(), in the order they run.
+// TRACE_TELL is the work done in tell() (splitting
+// the input and finding the user's name).
+enum trace_stage : uint8_t
+{
+    TRACE_TELL,
+    TRACE_EMPTY,
+    TRACE_REPEAT,
+    TRACE_RANK_0,
+    TRACE_RANK_1,
+    TRACE_RANK_2,
+    TRACE_RANK_3,
+    TRACE_RANK_4,
+    TRACE_MISC,
+    TRACE_STAGES
+};
+
+// One record per turn
+//  session: ID of the Chatbot
+//  turn: number of the turn within the session
+//  stage: stage that chose the reply
+//  branch: kind of match within the stage (Ranks 1, 3 and 4 have several)
+//  tense: input tense (Chatbot::tense, NONE if not found)
+//  subject: index of the subject in subj_pros (-1 if none)
+//  keychain: index of the keychain that matched in its rank (-1 if none)
+//  key: index of the key that matched (-1 if none)
+//  reply: index of the chosen output (-1 if none was picked)
+//  flags: TRACE_FUZZY if a key only matched with typos
+//  stage_ns: nanoseconds spent in each stage (0 if it did not run);
+//      a stage that takes longer than UINT32_MAX ns (about 4.29 s)
+//      is recorded as UINT32_MAX (see trace_add_ns())
+typedef struct trace_record_t
+{
+    uint64_t session;
+    uint32_t turn;
+    uint8_t stage;
+    uint8_t branch;
+    uint8_t tense;
+    int8_t subject;
+    int16_t keychain;
+    int16_t key;
+    int16_t reply;
+    uint16_t flags;
+    uint32_t stage_ns[TRACE_STAGES];
+} trace_record_t;
+
+static_assert(sizeof(trace_record_t) == 64, "trace_record_t should fill one cache line");
+
+const uint16_t TRACE_FUZZY = 1;
+
+const char trace_magic[4] = {'C', 'B', 'T', 'R'};
+const uint32_t trace_version = 1;
+const uint64_t trace_ring_size = 4096; // Must be a power of two
+
+const char *const trace_stage_names[TRACE_STAGES] = {"tell", "empty", "repeat", "rank_0", "rank_1", "rank_2", "rank_3", "rank_4", "misc"};
+// Same order as Chatbot::tense
+const char *const trace_tense_names[] = {"PAST_SIMP", "PAST_PRO", "PAST_PERF", "PAST_PERFPRO", "PRES_SIMP", "PRES_PRO", "PRES_PERF", "PRES_PERFPRO", "FUT_SIMP", "FUT_PRO", "FUT_PERF", "FUT_PERFPRO", "NONE"};
+
+const size_t trace_record_words = sizeof(trace_record_t) / sizeof(uint64_t);
+
+// Each thread writes to its own ring, so writing needs no lock.
+// head counts all records ever written; the newest is at head - 1.
+// trace_collect() may read a slot while it is written, so each
+// slot is a seqlock: the record is kept as atomic words, and
+// sequences[slot] is 2 * i + 1 while record i is being written
+// there and 2 * i + 2 once it is whole.
+typedef struct trace_ring_t
+{
+    std::array<std::array<std::atomic<uint64_t>, trace_record_words>, trace_ring_size> records;
+    std::array<std::atomic<uint64_t>, trace_ring_size> sequences{};
+    std::atomic<uint64_t> head{0};
+} trace_ring_t;
+
+// Every ring ever made, so trace_collect() can read them all.
+// When a thread exits, its ring goes on trace_free_rings and the
+// next new thread writes to it, so there are only as many rings
+// as threads that ever traced at the same time. Records stay in
+// a ring until its next owner overwrites them.
+inline std::mutex trace_rings_mutex;
+inline std::vector<std::shared_ptr<trace_ring_t>> trace_rings;
+inline std::vector<trace_ring_t *> trace_free_rings;
+
+// A thread's hold on a ring, given back when the thread exits
+struct trace_ring_lease
+{
+    trace_ring_t *ring;
+
+    trace_ring_lease()
+    {
+        std::lock_guard<std::mutex> lock(trace_rings_mutex);
+        if (!trace_free_rings.empty())
+        {
+            ring = trace_free_rings.back();
+            trace_free_rings.pop_back();
+        }
+        else
+        {
+            trace_rings.push_back(std::make_shared<trace_ring_t>());
+            ring = trace_rings.back().get();
+        }
+    }
+
+    ~trace_ring_lease()
+    {
+        std::lock_guard<std::mutex> lock(trace_rings_mutex);
+        trace_free_rings.push_back(ring);
+    }
+};
+
+// Function: trace_local_ring()
+// Returns the calling thread's ring, taking
+// a free one or making one on first use.
+inline trace_ring_t &trace_local_ring()
+{
+    thread_local trace_ring_lease lease;
+    return *lease.ring;
+}
+
+// Function: trace_new_session()
+// Returns a new session ID
+inline uint64_t trace_new_session()
+{
+    static std::atomic<uint64_t> next_session{1};
+    return next_session.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Function: trace_add_ns()
+// Adds ns to a stage_ns field, stopping
+// at UINT32_MAX instead of wrapping
+inline void trace_add_ns(uint32_t &field, uint64_t ns)
+{
+    field = uint32_t(std::min<uint64_t>(uint64_t(field) + ns, UINT32_MAX));
+}
+
+// Function: trace_write()
+// Adds a record to the calling thread's ring,
+// overwriting the oldest one if it is full.
+inline void trace_write(const trace_record_t &record)
+{
+    trace_ring_t &ring = trace_local_ring();
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    size_t slot = head & (trace_ring_size - 1);
+    uint64_t words[trace_record_words];
+    memcpy(words, &record, sizeof(record));
+
+    // Mark the slot as being written before any word of it changes
+    ring.sequences[slot].store(2 * head + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < trace_record_words; i++)
+        ring.records[slot][i].store(words[i], std::memory_order_relaxed);
+    ring.sequences[slot].store(2 * head + 2, std::memory_order_release);
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+// Function: trace_read()
+// Copies record i of a ring into record.
+// Returns false if the slot no longer holds
+// record i whole (it was overwritten, or is
+// being written while we copy it).
+inline bool trace_read(const trace_ring_t &ring, uint64_t i, trace_record_t &record)
+{
+    size_t slot = i & (trace_ring_size - 1);
+    uint64_t sequence = ring.sequences[slot].load(std::memory_order_acquire);
+    if (sequence != 2 * i + 2)
+        return false;
+
+    uint64_t words[trace_record_words];
+    for (size_t j = 0; j < trace_record_words; j++)
+        words[j] = ring.records[slot][j].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (ring.sequences[slot].load(std::memory_order_relaxed) != sequence)
+        return false;
+
+    memcpy(&record, words, sizeof(record));
+    return true;
+}
+
+// Function: trace_collect()
+// Copies the records of every ring, oldest first
+// within each ring. A ring may be written while
+// we copy it, so records that are overwritten
+// or half written when we get to them are
+// dropped (see trace_read()).
+inline std::vector<trace_record_t> trace_collect()
+{
+    std::vector<std::shared_ptr<trace_ring_t>> rings;
+    {
+        std::lock_guard<std::mutex> lock(trace_rings_mutex);
+        rings = trace_rings;
+    }
+
+    std::vector<trace_record_t> result;
+    for (const std::shared_ptr<trace_ring_t> &ring : rings)
+    {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head > trace_ring_size ? head - trace_ring_size : 0;
+        trace_record_t record;
+        for (uint64_t i = first; i < head; i++)
+            if (trace_read(*ring, i, record))
+                result.push_back(record);
+    }
+    return result;
+}
+
+// Function: trace_dump()
+// Writes every record to out: a header (magic,
+// version, record size, count) and then the
+// records as they are in memory.
+inline void trace_dump(std::ostream &out)
+{
+    std::vector<trace_record_t> records = trace_collect();
+    uint32_t record_size = sizeof(trace_record_t);
+    uint64_t count = records.size();
+
+    out.write(trace_magic, sizeof(trace_magic));
+    out.write(reinterpret_cast<const char *>(&trace_version), sizeof(trace_version));
+    out.write(reinterpret_cast<const char *>(&record_size), sizeof(record_size));
+    out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char *>(records.data()), count * sizeof(trace_record_t));
+}
+
+// Function: trace_print()
+// Writes one record to out as a line of text
+inline void trace_print(const trace_record_t &record, std::ostream &out)
+{
+    out << "session " << record.session << " turn " << record.turn;
+    if (record.stage < TRACE_STAGES)
+        out << " stage " << trace_stage_names[record.stage];
+    else
+        out << " stage ?";
+    out << " branch " << int(record.branch);
+    if (record.tense < sizeof(trace_tense_names) / sizeof(trace_tense_names[0]))
+        out << " tense " << trace_tense_names[record.tense];
+    out << " subject " << int(record.subject)
+        << " keychain " << record.keychain
+        << " key " << record.key
+        << " reply " << record.reply;
+    if (record.flags & TRACE_FUZZY)
+        out << " fuzzy";
+    out << " ns";
+    for (int stage = 0; stage < TRACE_STAGES; stage++)
+        if (record.stage_ns[stage] != 0)
+            out << ' ' << trace_stage_names[stage] << '=' << record.stage_ns[stage];
+    out << '\n';
+}
+
+// Function: trace_decode()
+// Reads a dump written by trace_dump() and
+// prints each record. Returns false if in
+// is not a dump this version can read.
+inline bool trace_decode(std::istream &in, std::ostream &out)
+{
+    char magic[sizeof(trace_magic)];
+    uint32_t version = 0;
+    uint32_t record_size = 0;
+    uint64_t count = 0;
+
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char *>(&version), sizeof(version));
+    in.read(reinterpret_cast<char *>(&record_size), sizeof(record_size));
+    in.read(reinterpret_cast<char *>(&count), sizeof(count));
+    if (!in || memcmp(magic, trace_magic, sizeof(magic)) != 0 || version != trace_version || record_size != sizeof(trace_record_t))
+        return false;
+
+    trace_record_t record;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (!in.read(reinterpret_cast<char *>(&record), sizeof(record)))
+            return false;
+        trace_print(record, out);
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,31 @@
+// chatbot_trace_decode.cpp
+// Prints a trace dump written by trace_dump() as text,
+// one line per turn.
+//
+// Usage: chatbot_trace_decode <dump file>
+
+#include <fstream>
+#include "chatbot_trace.h"
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <dump file>\n";
+        return 2;
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in)
+    {
+        std::cerr << "Cannot open " << argv[1] << "\n";
+        return 1;
+    }
+
+    if (!trace_decode(in, std::cout))
+    {
+        std::cerr << argv[1] << " is not a trace dump (or is cut short)\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,158 @@
+// chatbot_transcript_test.cpp
+// Checks that Chatbot still gives the same replies as
+// before: for each seed, conversations of made-up lines
+// are run (with rand() seeded the same way), and a hash
+// of the transcript is compared with the one the
+// original chatbot.h gave. The lines mix sentences,
+// verbs in every tense, keys and random words, with
+// punctuation and capitals put inside words and some
+// lines said again, so every stage gets used. The
+// hashes depend on glibc's rand().
+// Prints one line per seed and exits with 1 if any fail.
+//
+// Usage: chatbot_transcript_test
+//        chatbot_transcript_test <seed>
+//            Prints the transcript of one seed, to compare
+//            with the same program built on another chatbot.h
+
+#include <cctype>
+#include <cstdlib>
+#include <functional>
+#include "chatbot.h"
+
+// Fixed random numbers (xorshift64*), so the
+// lines don't depend on the platform
+typedef struct transcript_random_t
+{
+    uint64_t state;
+
+    unsigned int below(unsigned int limit)
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return (state * 2685821657736338717ull >> 32) % limit;
+    }
+} transcript_random_t;
+
+static const std::vector<std::string> sentences = {"hi", "hey there", "yo", "sup", "what's up", "do you like snacks?", "i love them!", "do you know why?", "because they are a source of comfort", "today is wednesday!", "why not?", "i guess that's true", "hakuna matata!", "hakuna", "it means no worries", "what a wonderful phrase", "bye!", "my name is Bob", "my name is", "call me Al", "what's my name?", "what is my name?", "i am walking the dog", "you are walking", "i walked to the store yesterday", "she has been crying all day", "they will have finished", "i will jump", "he was hopping over the fence", "we had tried", "i am not attractive", "i am happy", "you are so sad", "ha", "red", "banana", "i am going to the mall", "you are similar to a cat", "we are alike, you and me", "walk the walk", "why are you like this?", "what is your reason for that", "you're a robot", "you are not real", "i don't know", "thanks", "thank you so much", "you're welcome", "not much", "yes", "no.", "maybe", "how are you", "i'm sorry", "i ate pizza", "burn book", "what's your name", "the rules", "i'm a student", "i'll do it", "i don't like it", "going", "noice", "yikes", "purple", ""};
+
+static const std::vector<std::string> subjects = {"i", "you", "he", "she", "it", "we", "they", "i'm", "you're", "i'", "they'", "my dog", "the cat"};
+static const std::vector<std::string> helpers = {"", "will", "'ll", "will have", "will have been", "will be", "have", "'ve", "has", "have been", "has been", "am", "are", "is", "'m", "'re", "'s", "had", "had been", "was", "were", "did", "do", "don't", "can't"};
+static const std::vector<std::string> verbs = {"walk", "stop", "admit", "like", "love", "hate", "cry", "try", "marry", "jump", "play", "think", "eat", "drop", "smile", "move", "hop", "plan", "dance", "work", "hurry", "travel", "enjoy", "despise", "fight", "fought", "go", "be", "see"};
+static const std::vector<std::string> endings = {"", "", "ed", "ing", "s", "e", "ped", "ping", "ied", "d"};
+static const std::vector<std::string> words = {"a", "the", "my", "your", "me", "you", "myself", "yourself", "this", "that", "some", "many", "two", "first", "dog", "cat", "store", "day", "pizza", "food", "song", "not", "so", "very", "really", "alike", "same", "different", "similar", "equal", "the same", "not the same", "happy", "sad", "angry", "bored", "nice", "good ", "awful", "awesome", "tired", "upset", "because", "why", "who", "what", "how", "hello", "greetings", "thanks", "thx", "sorry", "idk", "yeah", "nope", "ok", "sure", "perhaps", "either", "wednesday", "pink", "gossip", "rules", "ponytail", "goodnight", "see ya", "adios", "hakuna", "matata", "philosophy", "craze", "going", "my name is", "call me", "i'm not", "am not", "cannot", "doesn't", "re fake", "re a bot", "you repeat", "not much", "nothing much", "no way", "i disagree", "of course", "i see", "i work", "i study", "i went to", "i'm going", "i will", "i'm about to", "i ate", "i like food", "hurray", "yippee", "oof", "hehe", "green", "blue", "violet", "helo", "thnks", "wensday", "anxius", "thing"};
+const unsigned int transcript_turns = 200; // Turns per conversation
+
+static const std::vector<std::string> marks = {"", "", "", "?", "!", ".", ",", "-", "'", "\"", ";", "  "};
+
+// Function: make_line()
+// Makes one line of a conversation
+static std::string make_line(transcript_random_t &random, const std::vector<std::string> &said)
+{
+    std::string line;
+    unsigned int kind = random.below(10);
+    if (kind == 0 && !said.empty())
+        return said[said.size() - 1 - random.below(std::min<size_t>(said.size(), 6))];
+    if (kind <= 3)
+        line = sentences[random.below(sentences.size())];
+    else if (kind <= 6)
+    {
+        line = subjects[random.below(subjects.size())];
+        std::string helper = helpers[random.below(helpers.size())];
+        if (helper != "")
+            line += (helper[0] == '\'' ? "" : " ") + helper;
+        line += " " + verbs[random.below(verbs.size())] + endings[random.below(endings.size())];
+        for (unsigned int i = random.below(4); i > 0; i--)
+            line += " " + words[random.below(words.size())];
+    }
+    else
+    {
+        for (unsigned int i = random.below(7); i > 0; i--)
+            line += (line.empty() ? "" : " ") + words[random.below(words.size())];
+    }
+
+    // Put punctuation or capitals inside some words
+    for (size_t i = 0; i < line.size(); i++)
+    {
+        unsigned int change = random.below(30);
+        if (change == 0)
+            line.insert(i, marks[random.below(marks.size())]);
+        else if (change == 1)
+            line[i] = toupper(line[i]);
+    }
+    return line + marks[random.below(4)];
+}
+
+// Function: run()
+// Runs the conversations of one seed, each
+// with a new Chatbot (so that not every line
+// is soon a repeat), calling out for each
+// line and its reply
+static void run(uint64_t seed, unsigned int sessions, const std::function<void(const std::string &, const std::string &)> &out)
+{
+    transcript_random_t random = {seed * 0x9e3779b97f4a7c15ull + 1};
+    srand(seed);
+    for (unsigned int session = 0; session < sessions; session++)
+    {
+        std::vector<std::string> said;
+        Chatbot bot("Chatty");
+        for (unsigned int turn = 0; turn < transcript_turns; turn++)
+        {
+            std::string line = make_line(random, said);
+            said.push_back(line);
+            bot.tell(line);
+            out(line, bot.get_reply());
+        }
+    }
+}
+
+// The hash of each seed's transcript with the original chatbot.h
+typedef struct transcript_check_t
+{
+    uint64_t seed;
+    unsigned int sessions;
+    uint64_t hash;
+} transcript_check_t;
+
+static const std::vector<transcript_check_t> checks = {
+    {1, 100, 0xd04896c34c9101d1ull},
+    {2, 100, 0xa77202aa45576ecbull},
+    {3, 100, 0x72a562571b29d924ull},
+    {4, 100, 0x31f9178d80d3c2e3ull},
+};
+
+int main(int argc, char **argv)
+{
+    if (argc == 2)
+    {
+        run(strtoull(argv[1], nullptr, 10), 100, [](const std::string &line, const std::string &reply) {
+            std::cout << line << " => " << reply << "\n";
+        });
+        return 0;
+    }
+
+    int failures = 0;
+    for (const transcript_check_t &check : checks)
+    {
+        // FNV-1a over "line => reply\n" for every turn
+        uint64_t hash = 14695981039346656037ull;
+        run(check.seed, check.sessions, [&](const std::string &line, const std::string &reply) {
+            for (char ch : line + " => " + reply + "\n")
+            {
+                hash ^= (unsigned char)ch;
+                hash *= 1099511628211ull;
+            }
+        });
+
+        bool passed = hash == check.hash;
+        std::cout << (passed ? "ok   " : "FAIL ") << "seed " << check.seed << ", " << check.sessions * transcript_turns << " lines";
+        if (!passed)
+        {
+            std::cout << " (hash " << std::hex << hash << std::dec << ")";
+            failures++;
+        }
+        std::cout << "\n";
+    }
+    return failures == 0 ? 0 : 1;
+}